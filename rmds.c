@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 /*
  * rmds.c - A utility to recursively remove .DS_Store files
  * Copyright (c) 2026, Vlad Shurupov. All rights reserved.
@@ -17,15 +19,212 @@
  * - Command-line flags for dry-run, quiet, verbose, and interactive modes.
  */
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+typedef enum { READER_READDIR, READER_GETDENTS } ReaderKind;
+
+typedef enum { IO_SYNC, IO_URING } IoKind;
+
+typedef enum { OUTPUT_TEXT, OUTPUT_PRINT0, OUTPUT_JSON } OutputMode;
+
+typedef enum { STATS_OFF, STATS_HUMAN, STATS_JSON } StatsMode;
+
+// Long options without a short form
+enum { OPT_READER = 256, OPT_IO, OPT_QUEUE_DEPTH, OPT_EXCLUDE_FROM,
+    OPT_PATTERN, OPT_EXCLUDE_PATTERN, OPT_DELETE_WORKERS, OPT_PRINT0,
+    OPT_JSON, OPT_STATS, OPT_CACHE, OPT_WATCH,
+    OPT_MAX_FDS, OPT_SORT_INODE, OPT_PLAN, OPT_APPLY, OPT_INDEX_BUILD,
+    OPT_FROM_INDEX, OPT_PROGRESS, OPT_MAX_OPS_PER_SEC, OPT_MAX_DIRS_PER_SEC,
+    OPT_IDLE };
+
+// Open-addressing hash set of names. It is filled while the options are
+// parsed and only read afterwards, so workers probe it without locking.
+// Names are copied into one pool and slots hold pool offsets (plus one,
+// so zero marks an empty slot).
+typedef struct {
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *slots;
+    uint32_t *hashes;
+    size_t mask;
+    size_t count;
+} NameSet;
+
+typedef struct {
+    uint64_t len_bits[4];
+    uint64_t *heads; // first 8 bytes of each name, zero padded
+    uint8_t *lens;
+    const char **names;
+    size_t count;
+    size_t padded; // heads/lens entries, a multiple of the vector width
+} TargetSet;
+
+bool target_set_contains(const TargetSet *set, const char *name, size_t len);
+
+enum { GLOB_TARGET = 1, GLOB_EXCLUDE = 2 };
+
+typedef struct {
+    const char **patterns;
+    uint8_t *pattern_tags;
+    int pattern_count;
+    uint8_t byte_class[256];
+    int class_count;
+    uint32_t *next;
+    uint8_t *accept;
+    int state_count;
+} GlobSet;
+
+// --cache file layout: a header, then the directory records sorted by
+// (dev, ino), then the subdirectory lists the records point into, then
+// their names. Fields are host-endian; the cache is meant to stay on the
+// machine that wrote it.
+#define CACHE_MAGIC "RMDSCACH"
+#define CACHE_VERSION 1
+
+enum { CACHE_CLEAN = 1, CACHE_DENIED = 2 };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;
+    uint64_t config_hash;
+    uint64_t subdir_count;
+    uint64_t names_len;
+} CacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t time_sec; // mtime, or ctime for a denied directory
+    uint32_t time_nsec;
+    uint32_t flags;
+    uint32_t subdir_first;
+    uint32_t subdir_count;
+} CacheRecord;
+
+typedef struct {
+    uint64_t ino;
+    uint32_t name_offset;
+    uint32_t name_len;
+} CacheSubdir;
+
+// The previous run's cache, mapped read-only for the whole run.
+typedef struct {
+    const char *path;
+    void *map;
+    size_t map_len;
+    const CacheRecord *records;
+    size_t record_count;
+    const CacheSubdir *subdirs;
+    size_t subdir_count;
+    const char *names;
+    size_t names_len;
+    uint64_t config_hash;
+    int64_t cutoff; // mtimes from here on are too recent to trust
+} CacheFile;
+
+// --plan file layout: a header, then the directories holding targets
+// sorted by path, then the targets of each directory in turn, then the
+// paths and names, each NUL-terminated. A directory and every target in
+// it are identified by device and inode as well as by name, so --apply
+// can tell when something was replaced after the plan was made. Fields
+// are host-endian, as in the cache.
+#define PLAN_MAGIC "RMDSPLAN"
+#define PLAN_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_count;
+    uint64_t entry_count;
+    uint64_t names_len;
+} PlanHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t path_offset;
+    uint32_t path_len;
+    uint32_t root_len; // of the starting path the directory is under
+    uint32_t reserved;
+    uint32_t entry_first;
+    uint32_t entry_count;
+} PlanDir;
+
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    uint32_t name_offset;
+    uint32_t name_len;
+} PlanEntry;
+
+// --index-build file layout: a header, the restart offsets, then one
+// record per entry in path order, each path front-coded against the one
+// before it. Paths are ordered with '/' below every other byte, so a
+// directory's whole subtree follows it without a gap. Every
+// INDEX_RESTART-th record stores its whole path, and the offsets of those
+// records let a query for one subtree binary-search its way in. Record
+// fields are LEB128 varints except for two bytes:
+//
+//   shared      bytes taken over from the previous path
+//   suffix_len  followed by that many bytes, the rest of the path
+//   type        byte, the DT_* value
+//   flags       byte, INDEX_MATCH when it was a target at build time,
+//               INDEX_TOP when it sits right in a starting path
+//   size        st_size, 0 for directories
+//   ino
+//   dev         st_dev, 0 for a directory known only from its d_type
+//
+// The header and offsets are host-endian, as in the cache.
+#define INDEX_MAGIC "RMDSINDX"
+#define INDEX_VERSION 3
+#define INDEX_RESTART 64
+
+enum { INDEX_MATCH = 1, INDEX_TOP = 2 };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entry_count;
+    uint64_t restart_count;
+    uint64_t data_len;
+    uint64_t config_hash; // of the targets INDEX_MATCH was set for
+} IndexHeader;
 
 typedef struct {
     bool dry_run;
@@ -34,13 +233,74 @@ typedef struct {
     bool interactive;
     int max_depth;
     bool one_file_system;
-    dev_t root_dev;
-    char **excludes;
-    int exclude_count;
-    const char *target_name;
+    NameSet excludes;
+    TargetSet targets;
     bool clean_all;
+    GlobSet globs;
+    bool has_target_patterns;
+    bool has_exclude_patterns;
+    ReaderKind reader;
+    int jobs;
+    bool auto_jobs;   // -j auto: jobs is the most workers that may run
+    double cpu_limit; // CPUs the process may use, for -j auto
+    int delete_workers;
+    IoKind io;
+    int queue_depth;
+    OutputMode output;
+    StatsMode stats;
+    CacheFile cache;
+    bool watch;
+    bool follow;
+    int max_fds;
+    bool sort_inode;
+    const char *plan;
+    const char *apply;
+    const char *index_build;
+    const char *from_index;
+    bool progress;
+    long max_ops_per_sec;
+    long max_dirs_per_sec;
+    bool idle;
 } Options;
 
+typedef enum { PHASE_READDIR, PHASE_STAT, PHASE_UNLINK, PHASE_COUNT } Phase;
+
+// Errors are counted by errno; anything larger lands in the last slot.
+#define ERRNO_SLOTS 256
+
+// Size of a target that was never stated; it adds nothing to the space
+// reclaimed.
+#define SIZE_UNKNOWN UINT64_MAX
+
+// Per-worker counters, added up for the summary and --stats. Only the
+// phase times cost anything beyond an increment, and they are only taken
+// with --stats.
+typedef struct {
+    unsigned long stats_issued;
+    unsigned long stats_avoided;
+    unsigned long deleted;
+    unsigned long delete_failed;
+    unsigned long would_delete;
+    unsigned long dirs_opened;
+    unsigned long dirs_cached;
+    unsigned long denied_cached;
+    unsigned long dirs_parked;
+    unsigned long dirs_reopened;
+    unsigned long entries;
+    unsigned long long bytes_reclaimed;
+    unsigned long sized;        // deletions whose size was known
+    unsigned long allocations;
+    unsigned long matched;      // targets found
+    unsigned long error_count;  // all of errors[]
+    unsigned long throttled;    // waits in the I/O throttle
+    uint64_t throttle_ns;
+    int workers;      // scan workers active at the end (set by pool_counters)
+    int workers_peak; // and most active at once
+    unsigned long errors[ERRNO_SLOTS];
+    uint64_t wall_ns[PHASE_COUNT];
+    uint64_t cpu_ns[PHASE_COUNT];
+} Counters;
+
 void print_usage(const char *progname)
 {
     printf("Usage: %s [options] [path1] [path2] ...\n", progname);
@@ -52,268 +312,6982 @@ void print_usage(const char *progname)
     printf("  -q, --quiet            Suppress all output except errors\n");
     printf("  -v, --verbose          Display directories as they are "
            "scanned\n");
-    printf("  -i, --interactive      Prompt for confirmation before deleting "
-           "each file\n");
+    printf("  -i, --interactive      Scan first, then confirm deletions per "
+           "file, per\n"
+           "                         directory or all at once\n");
     printf("  -d, --max-depth <N>    Only scan directories at most N levels "
            "deep\n");
     printf("  -x, --one-file-system  Do not traverse directories on different "
            "filesystems\n");
+    printf("      --max-fds <N>      Keep at most about N directories open, "
+           "closing and later\n"
+           "                         reopening ancestors beyond that\n");
+    printf("  -L, --follow           Follow symbolic links to directories "
+           "(each directory is\n"
+           "                         still scanned only once)\n");
     printf("  -e, --exclude <DIR>    Exclude directory name from scan (can be "
            "used multiple times)\n");
+    printf("      --exclude-from <FILE>\n"
+           "                         Exclude every directory name listed in "
+           "FILE, one per line\n");
     printf("  -m, --name <NAME>      Target filename to delete (defaults to "
-           ".DS_Store)\n");
+           ".DS_Store, can be\n"
+           "                         used multiple times)\n");
+    printf("      --pattern <GLOB>   Delete files whose name matches GLOB "
+           "(can be used\n"
+           "                         multiple times)\n");
+    printf("      --exclude-pattern <GLOB>\n"
+           "                         Exclude directories whose name matches "
+           "GLOB\n");
+    printf("  -j, --jobs <N>         Scan with N worker threads (defaults to "
+           "1, or one per\n"
+           "                         device when the paths span several); "
+           "with 'auto',\n"
+           "                         adjust the count to the device and CPU "
+           "quota\n");
+    printf("      --delete-workers <N>\n"
+           "                         Hand deletions to N background threads "
+           "so slow unlinks\n"
+           "                         do not stall the scan\n");
+    printf("      --sort-inode       Handle each directory's entries in inode "
+           "order, which turns\n"
+           "                         scattered metadata reads into mostly "
+           "sequential ones on\n"
+           "                         spinning disks\n");
+    printf("      --reader <ENGINE>  Directory reader: getdents (Linux default) "
+           "or readdir\n");
+    printf("      --io <ENGINE>      Stat/unlink engine: sync (default) or "
+           "uring (Linux io_uring,\n"
+           "                         falls back to sync when unavailable)\n");
+    printf("      --queue-depth <N>  io_uring requests in flight per worker "
+           "(defaults to 64)\n");
+    printf("      --print0           Print only the paths of deleted files, "
+           "each followed by NUL\n");
+    printf("      --json             Print one JSON object per event "
+           "(NDJSON), errors included\n");
+    printf("      --stats[=FORMAT]   Print counters, phase times and peak "
+           "memory to stderr\n"
+           "                         at exit; FORMAT is human (default) or "
+           "json\n");
+    printf("      --cache <FILE>     Remember directories without targets in "
+           "FILE and skip\n"
+           "                         reading them while their mtime is "
+           "unchanged\n");
+    printf("      --watch            Keep running after the scan and delete "
+           "targets as they\n"
+           "                         are created (Linux, until SIGINT or "
+           "SIGTERM)\n");
+    printf("      --plan <FILE>      Scan without deleting and write the "
+           "targets found to\n"
+           "                         FILE for a later --apply\n");
+    printf("      --apply <FILE>     Delete the targets listed in a --plan "
+           "FILE without\n"
+           "                         scanning, skipping any replaced since\n");
+    printf("      --index-build <FILE>\n"
+           "                         Scan without deleting and write an "
+           "index of every\n"
+           "                         entry to FILE for --from-index\n");
+    printf("      --from-index <FILE>\n"
+           "                         Find targets in an index FILE instead "
+           "of scanning,\n"
+           "                         limited to the given paths if any\n");
+    printf("      --progress         Show a live status line on stderr while "
+           "scanning\n");
+    printf("      --max-ops-per-sec <N>\n"
+           "                         Limit directory reads, stats and "
+           "unlinks to N per\n"
+           "                         second across all threads\n");
+    printf("      --max-dirs-per-sec <N>\n"
+           "                         Limit directories scanned to N per "
+           "second\n");
+    printf("      --idle             Only use otherwise idle disk and CPU "
+           "time\n");
     printf("  -h, --help             Display this help menu\n");
     printf("\nArguments:\n");
     printf("  paths                  One or more directories to scan (defaults "
            "to $HOME)\n");
 }
 
-bool is_excluded(const char *name, const Options *opts)
+// FNV-1a
+uint32_t name_hash(const char *name)
 {
-    for (int i = 0; i < opts->exclude_count; i++) {
-        if (strcmp(name, opts->excludes[i]) == 0) {
-            return true;
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+// Returns the slot holding `name`, or the empty slot where it belongs.
+size_t name_set_find(const NameSet *set, const char *name, uint32_t hash)
+{
+    size_t i = hash & set->mask;
+    while (set->slots[i] != 0) {
+        if (set->hashes[i] == hash &&
+                strcmp(set->pool + set->slots[i] - 1, name) == 0) {
+            break;
         }
+        i = (i + 1) & set->mask;
     }
-    return false;
+    return i;
 }
 
-bool is_target(const char *name, const Options *opts)
+// Keeps the table at most half full, doubling it when needed.
+bool name_set_reserve(NameSet *set, size_t count)
 {
-    if (opts->clean_all) {
-        return (strcmp(name, ".DS_Store") == 0 || strncmp(name, "._", 2) == 0);
+    size_t cap = set->slots ? set->mask + 1 : 0;
+    if (count * 2 <= cap) {
+        return true;
+    }
+    size_t new_cap = cap ? cap : 16;
+    while (count * 2 > new_cap) {
+        new_cap *= 2;
+    }
+    NameSet grown = *set;
+    grown.slots = calloc(new_cap, sizeof(*grown.slots));
+    grown.hashes = malloc(new_cap * sizeof(*grown.hashes));
+    if (!grown.slots || !grown.hashes) {
+        free(grown.slots);
+        free(grown.hashes);
+        return false;
     }
-    return (strcmp(name, opts->target_name) == 0);
+    grown.mask = new_cap - 1;
+    for (size_t i = 0; i < cap; i++) {
+        if (set->slots[i] != 0) {
+            size_t j = set->hashes[i] & grown.mask;
+            while (grown.slots[j] != 0) {
+                j = (j + 1) & grown.mask;
+            }
+            grown.slots[j] = set->slots[i];
+            grown.hashes[j] = set->hashes[i];
+        }
+    }
+    free(set->slots);
+    free(set->hashes);
+    *set = grown;
+    return true;
 }
 
-// Recursively deletes target files in the specified directory,
-// including any subdirectories.
-void remove_dsstore(const char *path, const Options *opts, int current_depth)
+bool name_set_add(NameSet *set, const char *name)
 {
-    // Check depth limit
-    if (opts->max_depth != -1 && current_depth > opts->max_depth) {
-        return;
+    if (!name_set_reserve(set, set->count + 1)) {
+        return false;
+    }
+    uint32_t hash = name_hash(name);
+    size_t i = name_set_find(set, name, hash);
+    if (set->slots[i] != 0) {
+        return true;
     }
 
-    struct dirent *entry;
-    DIR *dir = opendir(path);
-    if (!dir) {
-        if (!opts->quiet) {
-            // macOS often returns EPERM for protected Library folders (TCC)
-            // EACCES is standard permission denied.
-            if (errno == EACCES || errno == EPERM) {
-                if (opts->verbose) {
-                    printf("Skipping (Access Denied): %s\n", path);
-                }
-            } else {
-                fprintf(stderr, "Error opening directory '%s': %s\n", path,
-                        strerror(errno));
-            }
+    size_t len = strlen(name) + 1;
+    if (set->pool_len + len > set->pool_cap) {
+        size_t cap = set->pool_cap ? set->pool_cap * 2 : 1024;
+        while (set->pool_len + len > cap) {
+            cap *= 2;
         }
-        return;
+        char *grown = realloc(set->pool, cap);
+        if (!grown) {
+            return false;
+        }
+        set->pool = grown;
+        set->pool_cap = cap;
     }
+    memcpy(set->pool + set->pool_len, name, len);
+    set->slots[i] = (uint32_t)set->pool_len + 1;
+    set->hashes[i] = hash;
+    set->pool_len += len;
+    set->count++;
+    return true;
+}
 
-    if (opts->verbose && !opts->quiet) {
-        printf("Scanning: %s\n", path);
+bool name_set_contains(const NameSet *set, const char *name)
+{
+    if (set->count == 0) {
+        return false;
     }
+    return set->slots[name_set_find(set, name, name_hash(name))] != 0;
+}
+
+void name_set_free(NameSet *set)
+{
+    free(set->pool);
+    free(set->slots);
+    free(set->hashes);
+}
 
-    char fullpath[4096];
+// Exact target names (--name, plus .DS_Store for -A). Most entries are
+// rejected by a bitmap of the lengths present in the set. Survivors have
+// their first 8 bytes compared against every target's at once, four per
+// vector compare, and only a hit costs a full comparison.
+typedef uint64_t HeadVec __attribute__((vector_size(32)));
 
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+#define TARGET_LANES (sizeof(HeadVec) / sizeof(uint64_t))
 
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
+bool target_set_add(TargetSet *set, const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > NAME_MAX) {
+        return true; // no directory entry can match
+    }
+    if (target_set_contains(set, name, len)) {
+        return true;
+    }
 
-        struct stat statbuf;
-        if (lstat(fullpath, &statbuf) == -1) {
-            if (!opts->quiet) {
-                fprintf(stderr, "Error stating '%s': %s\n", fullpath,
-                        strerror(errno));
+    size_t padded = (set->count + TARGET_LANES) / TARGET_LANES * TARGET_LANES;
+    if (padded > set->padded) {
+        uint64_t *heads = realloc(set->heads, padded * sizeof(*heads));
+        if (!heads) {
+            return false;
+        }
+        set->heads = heads;
+        for (size_t i = set->padded; i < padded; i++) {
+            set->heads[i] = 0;
+        }
+        uint8_t *lens = realloc(set->lens, padded);
+        if (!lens) {
+            return false;
+        }
+        set->lens = lens;
+        memset(set->lens + set->padded, 0, padded - set->padded);
+        set->padded = padded;
+    }
+    const char **names =
+            realloc(set->names, (set->count + 1) * sizeof(*names));
+    if (!names) {
+        return false;
+    }
+    set->names = names;
+
+    uint64_t head = 0;
+    memcpy(&head, name, len < 8 ? len : 8);
+    set->heads[set->count] = head;
+    set->lens[set->count] = (uint8_t)len;
+    set->names[set->count++] = name;
+    set->len_bits[len >> 6] |= 1ull << (len & 63);
+    return true;
+}
+
+// `name` is read straight out of the directory buffer; `len` is its
+// strlen().
+bool target_set_contains(const TargetSet *set, const char *name, size_t len)
+{
+    if (len > NAME_MAX || !((set->len_bits[len >> 6] >> (len & 63)) & 1)) {
+        return false;
+    }
+
+    uint64_t head = 0;
+    memcpy(&head, name, len < 8 ? len : 8);
+    HeadVec key = {head, head, head, head};
+    for (size_t i = 0; i < set->padded; i += TARGET_LANES) {
+        HeadVec block;
+        memcpy(&block, set->heads + i, sizeof(block));
+        HeadVec eq = block == key;
+        if (!(eq[0] | eq[1] | eq[2] | eq[3])) {
+            continue;
+        }
+        for (size_t lane = 0; lane < TARGET_LANES; lane++) {
+            if (eq[lane] && set->lens[i + lane] == len &&
+                    (len <= 8 ||
+                            memcmp(name + 8, set->names[i + lane] + 8,
+                                    len - 8) == 0)) {
+                return true;
             }
+        }
+    }
+    return false;
+}
+
+void target_set_free(TargetSet *set)
+{
+    free(set->heads);
+    free(set->lens);
+    free(set->names);
+}
+
+// Adds every line of `path` to the exclude set. Blank lines and lines
+// starting with '#' are ignored.
+bool load_exclude_file(const char *path, Options *opts)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening exclude file '%s': %s\n", path,
+                strerror(errno));
+        return false;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
             continue;
         }
+        if (!name_set_add(&opts->excludes, line)) {
+            fprintf(stderr, "Memory allocation failed for excludes.\n");
+            ok = false;
+            break;
+        }
+    }
+    if (ok && ferror(fp)) {
+        fprintf(stderr, "Error reading exclude file '%s': %s\n", path,
+                strerror(errno));
+        ok = false;
+    }
+    free(line);
+    fclose(fp);
+    return ok;
+}
 
-        if (S_ISDIR(statbuf.st_mode)) {
-            // Check exclusion
-            if (is_excluded(entry->d_name, opts)) {
-                if (opts->verbose && !opts->quiet) {
-                    printf("Skipping (excluded): %s\n", fullpath);
-                }
-                continue;
-            }
+// Glob patterns (--pattern and --exclude-pattern) are compiled together
+// into one DFA whose accepting states carry the GLOB_* bits of every
+// pattern they complete, so classifying a name is a single pass over its
+// bytes however many patterns are loaded. Matching follows fnmatch(3)
+// without flags: '*', '?', bracket expressions with ranges, negation and
+// [:class:] names, and backslash escapes.
+//
+// Once a pattern is down to a trailing '*' it matches whatever follows,
+// so the DFA state keeps just its tag as a sticky bit (a pseudo position
+// past the real ones) and forgets every position of patterns with that
+// tag. Without this, "*foo*"-style lists would need a state for every
+// subset of patterns already seen.
+#define GLOB_MAX_STATES 65536
 
-            // Check filesystem boundary
-            if (opts->one_file_system && statbuf.st_dev != opts->root_dev) {
-                if (opts->verbose && !opts->quiet) {
-                    printf("Skipping (different filesystem): %s\n", fullpath);
-                }
-                continue;
-            }
+typedef struct {
+    bool star;
+    bool end;
+    uint8_t tag; // GLOB_* bit of the pattern owning the position
+    uint8_t set[32];
+} GlobToken;
+
+typedef struct {
+    GlobToken *tokens;
+    size_t count;
+    size_t cap;
+} GlobNfa;
+
+bool glob_nfa_grow(GlobNfa *nfa)
+{
+    if (nfa->count < nfa->cap) {
+        return true;
+    }
+    size_t cap = nfa->cap ? nfa->cap * 2 : 64;
+    GlobToken *tokens = realloc(nfa->tokens, cap * sizeof(*tokens));
+    if (!tokens) {
+        return false;
+    }
+    nfa->tokens = tokens;
+    nfa->cap = cap;
+    return true;
+}
 
-            // Recurse into directory
-            remove_dsstore(fullpath, opts, current_depth + 1);
-        } else if (is_target(entry->d_name, opts)) {
-            bool should_delete = true;
+// Parses a bracket expression starting after '['. Returns the length
+// consumed up to and including ']', or 0 if the bracket is unterminated
+// (fnmatch then treats the '[' as a literal).
+size_t glob_parse_bracket(const char *p, uint8_t set[32])
+{
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {{"alnum", isalnum}, {"alpha", isalpha},
+            {"blank", isblank}, {"cntrl", iscntrl}, {"digit", isdigit},
+            {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+            {"punct", ispunct}, {"space", isspace}, {"upper", isupper},
+            {"xdigit", isxdigit}};
 
-            if (opts->interactive) {
-                printf("Delete %s? (y/N): ", fullpath);
-                char response = getchar();
-                // Clear input buffer
-                if (response != '\n' && response != EOF) {
-                    int c;
-                    while ((c = getchar()) != '\n' && c != EOF)
-                        ;
+    const char *start = p;
+    bool negate = false;
+    uint8_t chars[32] = {0};
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        p++;
+    }
+    bool first = true;
+    while (*p && (*p != ']' || first)) {
+        first = false;
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            size_t i;
+            for (i = 0; end && i < sizeof(classes) / sizeof(classes[0]); i++) {
+                if (strlen(classes[i].name) == (size_t)(end - p - 2) &&
+                        strncmp(p + 2, classes[i].name, end - p - 2) == 0) {
+                    break;
                 }
-                if (response != 'y' && response != 'Y') {
-                    should_delete = false;
+            }
+            if (end && i < sizeof(classes) / sizeof(classes[0])) {
+                for (int c = 1; c < 128; c++) {
+                    if (classes[i].test(c)) {
+                        chars[c >> 3] |= 1 << (c & 7);
+                    }
                 }
+                p = end + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        unsigned char lo = (unsigned char)*p++;
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            p++;
+            if (*p == '\\' && p[1]) {
+                p++;
             }
+            hi = (unsigned char)*p++;
+        }
+        for (unsigned c = lo; c <= hi; c++) {
+            chars[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    if (*p != ']') {
+        return 0;
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] = negate ? (uint8_t)~chars[i] : chars[i];
+    }
+    set[0] &= (uint8_t)~1; // never match the terminating NUL
+    return (size_t)(p - start) + 1;
+}
 
-            if (should_delete) {
-                if (opts->dry_run) {
-                    if (!opts->quiet) {
-                        printf("(dry-run) Would delete: %s\n", fullpath);
-                    }
-                } else {
-                    if (unlink(fullpath) == 0) {
-                        if (!opts->quiet) {
-                            printf("Deleted: %s\n", fullpath);
-                        }
-                    } else {
-                        fprintf(stderr, "Error deleting '%s': %s\n", fullpath,
-                                strerror(errno));
-                    }
+// Appends the positions of one pattern to the NFA.
+bool glob_nfa_add(GlobNfa *nfa, const char *pattern, uint8_t tag)
+{
+    for (const char *p = pattern; *p;) {
+        if (!glob_nfa_grow(nfa)) {
+            return false;
+        }
+        GlobToken *t = &nfa->tokens[nfa->count];
+        memset(t, 0, sizeof(*t));
+        t->tag = tag;
+        if (*p == '*') {
+            t->star = true;
+            while (*p == '*') {
+                p++;
+            }
+        } else if (*p == '?') {
+            memset(t->set, 0xff, sizeof(t->set));
+            t->set[0] &= (uint8_t)~1;
+            p++;
+        } else {
+            size_t used = *p == '[' ? glob_parse_bracket(p + 1, t->set) : 0;
+            if (used) {
+                p += used + 1;
+            } else {
+                if (*p == '\\' && p[1]) {
+                    p++;
                 }
+                unsigned char c = (unsigned char)*p++;
+                t->set[c >> 3] |= 1 << (c & 7);
             }
         }
+        nfa->count++;
+    }
+    if (!glob_nfa_grow(nfa)) {
+        return false;
     }
+    GlobToken *end = &nfa->tokens[nfa->count++];
+    memset(end, 0, sizeof(*end));
+    end->end = true;
+    end->tag = tag;
+    return true;
+}
+
+// A set of NFA positions under construction, deduplicated by stamp.
+typedef struct {
+    uint32_t *items;
+    size_t count;
+    uint32_t *stamp;
+    uint32_t generation;
+} PosSet;
 
-    closedir(dir);
+void pos_set_add(PosSet *s, const GlobNfa *nfa, uint32_t pos)
+{
+    // A star may also match nothing, so its successor comes along too.
+    for (;;) {
+        if (pos < nfa->count && nfa->tokens[pos].star &&
+                nfa->tokens[pos + 1].end) {
+            pos = (uint32_t)nfa->count + nfa->tokens[pos].tag - 1;
+        }
+        if (s->stamp[pos] == s->generation) {
+            return;
+        }
+        s->stamp[pos] = s->generation;
+        s->items[s->count++] = pos;
+        if (pos >= nfa->count || nfa->tokens[pos].end ||
+                !nfa->tokens[pos].star) {
+            return;
+        }
+        pos++;
+    }
 }
 
-int main(int argc, char *argv[])
+// Drops positions whose tag a sticky bit in the set already guarantees.
+void pos_set_prune(PosSet *s, const GlobNfa *nfa)
 {
-    Options opts = {.dry_run = false,
-            .quiet = false,
-            .verbose = false,
-            .interactive = false,
-            .max_depth = -1,
-            .one_file_system = false,
-            .root_dev = 0,
-            .excludes = NULL,
-            .exclude_count = 0,
-            .target_name = ".DS_Store",
-            .clean_all = false};
+    uint8_t sticky = 0;
+    for (size_t k = 0; k < s->count; k++) {
+        if (s->items[k] >= nfa->count) {
+            sticky |= (uint8_t)(s->items[k] - nfa->count + 1);
+        }
+    }
+    if (!sticky) {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t k = 0; k < s->count; k++) {
+        uint32_t pos = s->items[k];
+        if (pos >= nfa->count || (nfa->tokens[pos].tag & ~sticky)) {
+            s->items[kept++] = pos;
+        }
+    }
+    s->count = kept;
+}
 
-    static struct option long_options[] = {{"clean-all", no_argument, 0, 'A'},
-            {"dry-run", no_argument, 0, 'n'}, {"quiet", no_argument, 0, 'q'},
-            {"verbose", no_argument, 0, 'v'},
-            {"interactive", no_argument, 0, 'i'},
-            {"max-depth", required_argument, 0, 'd'},
-            {"one-file-system", no_argument, 0, 'x'},
-            {"exclude", required_argument, 0, 'e'},
-            {"name", required_argument, 0, 'm'}, {"help", no_argument, 0, 'h'},
-            {0, 0, 0, 0}};
+int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-    int opt;
-    while ((opt = getopt_long(
-                    argc, argv, "Anqvihd:xe:m:", long_options, NULL)) != -1) {
-        switch (opt) {
-        case 'A':
-            opts.clean_all = true;
-            break;
-        case 'n':
-            opts.dry_run = true;
-            break;
-        case 'q':
-            opts.quiet = true;
-            break;
-        case 'v':
-            opts.verbose = true;
-            break;
-        case 'i':
-            opts.interactive = true;
-            break;
-        case 'd':
-            opts.max_depth = atoi(optarg);
-            break;
-        case 'x':
-            opts.one_file_system = true;
-            break;
-        case 'e':
-            opts.excludes = realloc(
-                    opts.excludes, sizeof(char *) * (opts.exclude_count + 1));
-            if (opts.excludes == NULL) {
-                fprintf(stderr, "Memory allocation failed for excludes.\n");
-                return 1;
-            }
-            opts.excludes[opts.exclude_count++] = optarg;
-            break;
-        case 'm':
-            opts.target_name = optarg;
-            break;
-        case 'h':
-            print_usage(argv[0]);
-            return 0;
-        default:
-            print_usage(argv[0]);
-            return 1;
+bool glob_compile(GlobSet *g)
+{
+    GlobNfa nfa = {0};
+    for (int i = 0; i < g->pattern_count; i++) {
+        if (!glob_nfa_add(&nfa, g->patterns[i], g->pattern_tags[i])) {
+            free(nfa.tokens);
+            return false;
         }
     }
 
-    if (optind >= argc) {
-        // Default to HOME if no paths provided
-        const char *home = getenv("HOME");
-        if (!home) {
-            fprintf(stderr, "Could not determine starting path ($HOME).\n");
-            return 1;
+    // Bytes that every token treats alike share one column of the table.
+    memset(g->byte_class, 0, sizeof(g->byte_class));
+    g->class_count = 1;
+    for (size_t pos = 0; pos < nfa.count; pos++) {
+        if (nfa.tokens[pos].end || nfa.tokens[pos].star) {
+            continue;
         }
-
-        struct stat root_stat;
-        if (stat(home, &root_stat) == -1) {
-            fprintf(stderr, "Error stating starting path '%s': %s\n", home,
-                    strerror(errno));
-            return 1;
+        int remap[2][256];
+        memset(remap, -1, sizeof(remap));
+        int classes = 0;
+        for (int c = 0; c < 256; c++) {
+            int in = (nfa.tokens[pos].set[c >> 3] >> (c & 7)) & 1;
+            int *slot = &remap[in][g->byte_class[c]];
+            if (*slot == -1) {
+                *slot = classes++;
+            }
+            g->byte_class[c] = (uint8_t)*slot;
         }
-        opts.root_dev = root_stat.st_dev;
+        g->class_count = classes;
+    }
+    int class_byte[256];
+    for (int c = 255; c >= 0; c--) {
+        class_byte[g->byte_class[c]] = c;
+    }
 
-        if (!opts.quiet) {
-            if (opts.clean_all) {
-                printf("Cleaning all metadata (.DS_Store and ._*) in: %s\n",
-                        home);
+    // Subset construction. State 0 is the dead state, state 1 the start.
+    bool ok = false;
+    size_t set_cap = nfa.count + GLOB_TARGET + GLOB_EXCLUDE;
+    PosSet cur = {.items = malloc(set_cap * sizeof(uint32_t)),
+            .stamp = calloc(set_cap, sizeof(uint32_t))};
+    uint32_t **sets = NULL;
+    size_t *set_len = NULL;
+    uint32_t *table = NULL;
+    uint32_t *index = NULL;
+    size_t index_mask = 4095;
+    int states = 0;
+    size_t states_cap = 0;
+    if (!cur.items || !cur.stamp) {
+        goto out;
+    }
+    index = calloc(index_mask + 1, sizeof(*index));
+    if (!index) {
+        goto out;
+    }
+
+    for (int target = -1; target < states; target++) {
+        for (int cls = 0; cls < (target < 0 ? 2 : g->class_count); cls++) {
+            // Build the successor set of `target` on `cls` (or, before the
+            // first state exists, the dead and start sets).
+            cur.count = 0;
+            cur.generation++;
+            if (target < 0) {
+                if (cls == 1) {
+                    for (size_t pos = 0; pos < nfa.count;) {
+                        pos_set_add(&cur, &nfa, (uint32_t)pos);
+                        while (!nfa.tokens[pos].end) {
+                            pos++;
+                        }
+                        pos++;
+                    }
+                }
             } else {
-                printf("Scanning for %s files in: %s\n", opts.target_name,
-                        home);
+                int c = class_byte[cls];
+                for (size_t k = 0; k < set_len[target]; k++) {
+                    uint32_t pos = sets[target][k];
+                    if (pos >= nfa.count) {
+                        pos_set_add(&cur, &nfa, pos);
+                        continue;
+                    }
+                    const GlobToken *t = &nfa.tokens[pos];
+                    if (t->end) {
+                        continue;
+                    }
+                    if (t->star) {
+                        pos_set_add(&cur, &nfa, pos);
+                    } else if ((t->set[c >> 3] >> (c & 7)) & 1) {
+                        pos_set_add(&cur, &nfa, pos + 1);
+                    }
+                }
             }
-        }
-        remove_dsstore(home, &opts, 0);
-    } else {
-        // Process all provided paths
-        for (int i = optind; i < argc; i++) {
-            const char *path = argv[i];
-            struct stat root_stat;
-            if (stat(path, &root_stat) == -1) {
-                fprintf(stderr, "Error stating path '%s': %s\n", path,
-                        strerror(errno));
-                continue;
+            pos_set_prune(&cur, &nfa);
+            qsort(cur.items, cur.count, sizeof(uint32_t), cmp_u32);
+
+            uint32_t h = 2166136261u;
+            for (size_t k = 0; k < cur.count; k++) {
+                h = (h ^ cur.items[k]) * 16777619u;
+            }
+            size_t i = h & index_mask;
+            while (index[i] != 0) {
+                uint32_t id = index[i] - 1;
+                if (set_len[id] == cur.count &&
+                        memcmp(sets[id], cur.items,
+                                cur.count * sizeof(uint32_t)) == 0) {
+                    break;
+                }
+                i = (i + 1) & index_mask;
             }
-            opts.root_dev = root_stat.st_dev;
 
-            if (!opts.quiet) {
-                if (opts.clean_all) {
-                    printf("Cleaning all metadata (.DS_Store and ._*) in: %s\n",
-                            path);
-                } else {
-                    printf("Scanning for %s files in: %s\n", opts.target_name,
-                            path);
+            uint32_t id;
+            if (index[i] != 0) {
+                id = index[i] - 1;
+            } else {
+                if (states == GLOB_MAX_STATES) {
+                    fprintf(stderr, "Glob patterns are too complex to "
+                                    "compile.\n");
+                    goto out;
+                }
+                if ((size_t)states == states_cap) {
+                    states_cap = states_cap ? states_cap * 2 : 64;
+                    uint32_t **s2 = realloc(sets, states_cap * sizeof(*s2));
+                    size_t *l2 = s2 ? realloc(set_len,
+                                              states_cap * sizeof(*l2))
+                                    : NULL;
+                    uint32_t *t2 = l2 ? realloc(table,
+                                                states_cap * g->class_count *
+                                                        sizeof(*t2))
+                                      : NULL;
+                    if (s2) {
+                        sets = s2;
+                    }
+                    if (l2) {
+                        set_len = l2;
+                    }
+                    if (!t2) {
+                        goto out;
+                    }
+                    table = t2;
+                }
+                id = (uint32_t)states;
+                sets[id] = malloc((cur.count ? cur.count : 1) *
+                                  sizeof(uint32_t));
+                if (!sets[id]) {
+                    goto out;
+                }
+                memcpy(sets[id], cur.items, cur.count * sizeof(uint32_t));
+                set_len[id] = cur.count;
+                states++;
+                index[i] = id + 1;
+
+                // Keep the index at most half full
+                if ((size_t)states * 2 > index_mask + 1) {
+                    size_t mask = index_mask * 2 + 1;
+                    uint32_t *grown = calloc(mask + 1, sizeof(*grown));
+                    if (!grown) {
+                        goto out;
+                    }
+                    for (int s = 0; s < states; s++) {
+                        uint32_t sh = 2166136261u;
+                        for (size_t k = 0; k < set_len[s]; k++) {
+                            sh = (sh ^ sets[s][k]) * 16777619u;
+                        }
+                        size_t j = sh & mask;
+                        while (grown[j] != 0) {
+                            j = (j + 1) & mask;
+                        }
+                        grown[j] = (uint32_t)s + 1;
+                    }
+                    free(index);
+                    index = grown;
+                    index_mask = mask;
                 }
             }
-            remove_dsstore(path, &opts, 0);
+            if (target >= 0) {
+                table[(size_t)target * g->class_count + cls] = id;
+            }
+        }
+    }
+
+    g->accept = calloc(states, 1);
+    if (!g->accept) {
+        goto out;
+    }
+    for (int s = 0; s < states; s++) {
+        for (size_t k = 0; k < set_len[s]; k++) {
+            uint32_t pos = sets[s][k];
+            if (pos >= nfa.count) {
+                g->accept[s] |= (uint8_t)(pos - nfa.count + 1);
+            } else if (nfa.tokens[pos].end) {
+                g->accept[s] |= nfa.tokens[pos].tag;
+            }
+        }
+    }
+    g->next = table;
+    table = NULL;
+    g->state_count = states;
+    ok = true;
+
+out:
+    for (int s = 0; s < states; s++) {
+        free(sets[s]);
+    }
+    free(sets);
+    free(set_len);
+    free(table);
+    free(index);
+    free(cur.items);
+    free(cur.stamp);
+    free(nfa.tokens);
+    return ok;
+}
+
+bool glob_add(GlobSet *g, const char *pattern, uint8_t tag)
+{
+    const char **patterns = realloc(
+            g->patterns, (g->pattern_count + 1) * sizeof(*patterns));
+    if (!patterns) {
+        return false;
+    }
+    g->patterns = patterns;
+    uint8_t *tags = realloc(g->pattern_tags, g->pattern_count + 1);
+    if (!tags) {
+        return false;
+    }
+    g->pattern_tags = tags;
+    g->patterns[g->pattern_count] = pattern;
+    g->pattern_tags[g->pattern_count++] = tag;
+    return true;
+}
+
+// Returns the GLOB_* bits of every pattern matching `name`.
+uint8_t glob_match(const GlobSet *g, const char *name)
+{
+    if (!g->next) {
+        return 0;
+    }
+    uint32_t state = 1;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        state = g->next[(size_t)state * g->class_count + g->byte_class[*p]];
+        if (state == 0) {
+            return 0;
+        }
+    }
+    return g->accept[state];
+}
+
+void glob_free(GlobSet *g)
+{
+    free(g->patterns);
+    free(g->pattern_tags);
+    free(g->next);
+    free(g->accept);
+}
+
+bool is_excluded(const char *name, const Options *opts)
+{
+    return name_set_contains(&opts->excludes, name) ||
+           (opts->has_exclude_patterns &&
+                   (glob_match(&opts->globs, name) & GLOB_EXCLUDE));
+}
+
+bool is_target(const char *name, const Options *opts)
+{
+    if (target_set_contains(&opts->targets, name, strlen(name))) {
+        return true;
+    }
+    if (opts->clean_all && name[0] == '.' && name[1] == '_') {
+        return true;
+    }
+    return opts->has_target_patterns &&
+           (glob_match(&opts->globs, name) & GLOB_TARGET);
+}
+
+// A directory queued for, or being, scanned. Nodes link to their parent,
+// which is how paths are formatted and how a child finds the descriptor
+// to open itself relative to, so there is no PATH_MAX ceiling on how deep
+// the walk can go. `refs` keeps the node in memory (its own job plus each
+// child), while `fd_refs` keeps its descriptor open (the scan itself plus
+// each child that has not been opened yet).
+typedef struct DirNode {
+    struct DirNode *parent;
+    atomic_int refs;
+    atomic_int fd_refs;
+    int fd;
+    DIR *dir;
+    int depth;
+    dev_t root_dev;
+    dev_t dev;
+    ino_t ino;  // from the parent's directory entry, 0 for a root
+    bool dirty; // holds targets or had errors, so --cache must read it
+    bool follow; // reached through a symlink (-L)
+    int wd;      // --watch with inotify: its watch, -1 if none
+    atomic_bool scanned;
+    atomic_int deletes;  // queued for the deletion workers
+    ino_t parked_ino;    // identity to check when reopening, with `dev`
+    char name[];
+} DirNode;
+
+// Pending directories of one worker. The owner pushes and pops at the
+// tail, so its own walk stays depth-first; thieves take from the head,
+// where the shallowest and therefore largest subtrees sit.
+typedef struct {
+    pthread_mutex_t lock;
+    DirNode **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} Deque;
+
+// A block of formatted output. Workers fill their own and hand it to the
+// pool's writer once full.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+#define OUT_BUF_SIZE (64 * 1024)
+#define OUT_BATCH 16
+
+// Full buffers waiting to be written. They go out together in one
+// writev(), so a large cleanup costs a write per megabyte or so of output
+// instead of one per file.
+typedef struct {
+    pthread_mutex_t lock;
+    OutBuf queued[OUT_BATCH];
+    int queued_count;
+    OutBuf spare[OUT_BATCH];
+    int spare_count;
+    bool tty;
+    bool progress_shown; // the --progress line is on the terminal
+} Output;
+
+// Records for the next --cache file, collected per worker.
+typedef struct {
+    CacheRecord *records;
+    size_t count;
+    size_t cap;
+    CacheSubdir *subdirs;
+    size_t subdir_count;
+    size_t subdir_cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    bool failed;
+} CacheBuilder;
+
+// Records for the --plan file, collected per worker. A directory's record
+// is added along with its first target.
+typedef struct {
+    PlanDir *dirs;
+    size_t dir_count;
+    size_t dir_cap;
+    PlanEntry *entries;
+    size_t entry_count;
+    size_t entry_cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    uint64_t dev; // of the directory being scanned
+    uint64_t ino;
+    bool in_dir; // its record has been added
+    bool failed;
+} PlanBuilder;
+
+typedef struct {
+    size_t path; // offset into the builder's text
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    unsigned char type;
+    unsigned char flags;
+} IndexRecord;
+
+// Entries for the --index-build file, collected per worker with their
+// whole paths.
+typedef struct {
+    IndexRecord *records;
+    size_t count;
+    size_t cap;
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+    bool failed;
+} IndexBuilder;
+
+typedef struct {
+    ino_t ino;
+    size_t name; // offset into the worker's sorted_names
+    unsigned char type;
+} SortedEntry;
+
+// -i: a target found by the scan, deleted only once the user has said
+// so. The directory's path and name are offsets into the list's text.
+// The scanned directory is kept referenced so it can be reopened along
+// its chain, and its device and inode are checked again before deleting.
+typedef struct {
+    size_t dir;
+    size_t name;
+    uint64_t bytes;
+    DirNode *node;
+    dev_t dev;
+    ino_t ino;
+} Candidate;
+
+// A worker's candidates. Every target of a directory is found by the
+// worker scanning it, so they come in one run and share the path.
+typedef struct {
+    Candidate *items;
+    size_t count;
+    size_t cap;
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+} CandidateList;
+
+// Pending directories come from per-worker arenas of 16 KiB chunks
+// instead of a malloc each. A worker bump-allocates nodes from its
+// current chunk, and each chunk counts its live nodes; once the last one
+// is released, by whichever thread, the whole chunk goes back to its
+// owner's spare list at once. The walk is depth-first, so a chunk mostly
+// holds one subtree's nodes and empties as that subtree finishes.
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_SPARE_MAX 256
+
+typedef struct NodeArena NodeArena;
+
+typedef struct ArenaChunk {
+    NodeArena *arena;
+    struct ArenaChunk *next; // on the spare list
+    atomic_int live;         // nodes, plus one while it is being filled
+    size_t used;
+} ArenaChunk;
+
+struct NodeArena {
+    pthread_mutex_t lock; // guards the spare list, which any thread fills
+    ArenaChunk *spare;
+    int spare_count;
+    ArenaChunk *current;
+};
+
+// --progress: a worker's counters as of its last directory (a deleter's
+// as of its last batch), for the reporter thread to add up. When the
+// reporter asks for it, the worker hands over the directory it starts on
+// next, with a reference the reporter drops once it has the path.
+#define PROGRESS_PATH_MAX 512
+
+typedef struct {
+    atomic_ulong dirs;
+    atomic_ulong entries;
+    atomic_ulong matched;
+    atomic_ulong deleted;
+    atomic_ulong errors;
+    atomic_int depth; // of the directory being scanned, -1 when idle
+    atomic_bool want_path;
+    _Atomic(DirNode *) node; // handed over for its path
+} Progress;
+
+typedef struct Pool Pool;
+typedef struct IoRing IoRing;
+typedef struct DeleteQueue DeleteQueue;
+typedef struct VisitedSet VisitedSet;
+typedef struct Watcher Watcher;
+
+typedef struct {
+    Pool *pool;
+    int id;
+    pthread_t thread;
+    bool started;
+    Deque deque;
+    Counters counters;
+    char *path_buf;
+    size_t path_cap;
+    char *read_buf;
+    size_t read_cap;
+    IoRing *ring;
+    OutBuf out;
+    uint64_t span_ns[PHASE_COUNT]; // phase times of the current span
+    uint64_t span_wall;
+    uint64_t span_cpu;
+    CacheBuilder cache;
+    DirNode **park_buf;
+    size_t park_cap;
+    SortedEntry *sorted; // --sort-inode scratch
+    size_t sorted_cap;
+    char *sorted_names;
+    size_t sorted_names_cap;
+    NodeArena arena;
+    CandidateList review; // -i
+    PlanBuilder plan;
+    IndexBuilder index;
+    Progress progress;
+} Worker;
+
+struct Pool {
+    const Options *opts;
+    Worker *workers;
+    int count;
+    atomic_long pending; // nodes queued or being scanned
+    atomic_long queued;  // nodes sitting in a deque
+    atomic_int idle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_bool uring_failed;
+    DeleteQueue *deletes;
+    Worker *deleters;
+    int deleter_count;
+    Output out;
+    VisitedSet *visited; // with several starting paths or -L
+    Watcher *watcher;    // --watch with inotify, to watch each scanned dir
+    int lanes;           // worker i serves device lane i % lanes
+    // -j auto: workers with an id of `active` or more stay parked on
+    // park_cond. The scan workers add up their work for the tuner.
+    atomic_int active;
+    int active_peak;
+    pthread_cond_t park_cond;
+    atomic_ulong work_done; // directories and entries scanned
+    _Atomic uint64_t busy_ns; // time spent scanning them
+};
+
+// Heap allocations made by the calling thread while it runs as a worker,
+// added to its counters for --stats. Everything the scan loop allocates
+// goes through these so the count is complete.
+static _Thread_local unsigned long thread_allocs;
+
+void *counted_malloc(size_t size)
+{
+    thread_allocs++;
+    return malloc(size);
+}
+
+void *counted_realloc(void *p, size_t size)
+{
+    thread_allocs++;
+    return realloc(p, size);
+}
+
+void *counted_calloc(size_t count, size_t size)
+{
+    thread_allocs++;
+    return calloc(count, size);
+}
+
+// Directory descriptor budget (--max-fds). A directory keeps its
+// descriptor until its last subdirectory has been opened, so a very deep
+// tree, or many workers, can pile up thousands. Over the budget, scanned
+// directories up the chain are parked, root-most first: the descriptor is
+// closed and reopened on demand from the nearest open ancestor. Readers
+// of a descriptor that might be parked hold park_lock for reading;
+// parking and reopening hold it for writing. With no budget it is unused.
+static int fd_budget;
+static atomic_int open_dirs;
+static pthread_rwlock_t park_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Formats the path of `name` inside `dir` (or of `dir` itself when `name`
+// is NULL). The result lives in the worker's buffer until the next call.
+const char *format_path(Worker *w, const DirNode *dir, const char *name)
+{
+    // Every component but the first is preceded by a separator.
+    size_t len = name ? strlen(name) + 1 : 0;
+    for (const DirNode *n = dir; n; n = n->parent) {
+        len += strlen(n->name) + (n->parent ? 1 : 0);
+    }
+    if (len + 1 > w->path_cap) {
+        char *grown = counted_realloc(w->path_buf, len + 1);
+        if (!grown) {
+            return name ? name : dir->name;
+        }
+        w->path_buf = grown;
+        w->path_cap = len + 1;
+    }
+
+    // Fill from the end: the entry name first, then each ancestor.
+    char *p = w->path_buf + len;
+    *p = '\0';
+    if (name) {
+        size_t n = strlen(name);
+        p -= n;
+        memcpy(p, name, n);
+        *--p = '/';
+    }
+    for (const DirNode *n = dir; n; n = n->parent) {
+        size_t nl = strlen(n->name);
+        p -= nl;
+        memcpy(p, n->name, nl);
+        if (n->parent) {
+            *--p = '/';
+        }
+    }
+    return w->path_buf;
+}
+
+// Erases the --progress line, which is redrawn at the next tick. Called
+// with the output lock held.
+void out_clear_progress(Output *out)
+{
+    if (out->progress_shown) {
+        ssize_t ret = write(STDERR_FILENO, "\r\033[K", 4);
+        (void)ret;
+        out->progress_shown = false;
+    }
+}
+
+// Writes every queued buffer, as few writev() calls as the kernel allows,
+// and keeps the buffers for reuse. Called with the output lock held.
+void out_write_queued(Output *out)
+{
+    // Output and the --progress line share the terminal
+    if (out->progress_shown && out->tty && out->queued_count > 0) {
+        out_clear_progress(out);
+    }
+    struct iovec iov[OUT_BATCH];
+    int count = out->queued_count;
+    for (int i = 0; i < count; i++) {
+        iov[i] = (struct iovec){out->queued[i].data, out->queued[i].len};
+    }
+    struct iovec *next = iov;
+    while (count > 0) {
+        ssize_t done = writev(STDOUT_FILENO, next, count);
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // nowhere left to report it; drop the output
+        }
+        while (count > 0 && (size_t)done >= next->iov_len) {
+            done -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + done;
+            next->iov_len -= done;
+        }
+    }
+
+    for (int i = 0; i < out->queued_count; i++) {
+        OutBuf *buf = &out->queued[i];
+        if (buf->cap == OUT_BUF_SIZE && out->spare_count < OUT_BATCH) {
+            buf->len = 0;
+            out->spare[out->spare_count++] = *buf;
+        } else {
+            free(buf->data);
+        }
+    }
+    out->queued_count = 0;
+}
+
+// Hands the worker's buffer to the writer, which writes once a batch has
+// built up or, with `now`, straight away.
+void out_flush(Worker *w, bool now)
+{
+    Output *out = &w->pool->out;
+    if (w->out.len == 0 && !now) {
+        return;
+    }
+    pthread_mutex_lock(&out->lock);
+    if (w->out.len > 0) {
+        out->queued[out->queued_count++] = w->out;
+        w->out = out->spare_count > 0 ? out->spare[--out->spare_count]
+                                      : (OutBuf){0};
+    }
+    if (now || out->queued_count == OUT_BATCH) {
+        out_write_queued(out);
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+// Returns room for a message of up to `len` bytes. Messages never span
+// buffers, so lines from different workers do not interleave.
+char *out_reserve(Worker *w, size_t len)
+{
+    if (w->out.len + len > w->out.cap) {
+        out_flush(w, false);
+        if (len > w->out.cap) {
+            size_t cap = len > OUT_BUF_SIZE ? len : OUT_BUF_SIZE;
+            char *data = counted_malloc(cap);
+            if (!data) {
+                return NULL;
+            }
+            free(w->out.data);
+            w->out = (OutBuf){.data = data, .cap = cap};
+        }
+    }
+    return w->out.data + w->out.len;
+}
+
+void out_commit(Worker *w, size_t len)
+{
+    w->out.len += len;
+}
+
+// Adds a plain-text line; only used in the default output mode.
+void out_printf(Worker *w, const char *fmt, ...)
+{
+    if (w->pool->opts->output != OUTPUT_TEXT) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *p = len >= 0 ? out_reserve(w, len + 1) : NULL;
+    if (p) {
+        va_start(ap, fmt);
+        vsnprintf(p, len + 1, fmt, ap);
+        va_end(ap);
+        out_commit(w, len);
+    }
+}
+
+// Length of the valid UTF-8 sequence at `s`, or 0 if there is none.
+size_t utf8_sequence(const unsigned char *s)
+{
+    if (s[0] < 0x80) {
+        return 1;
+    }
+    size_t len;
+    uint32_t cp;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        cp = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        cp = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    // Overlong forms, surrogates and anything past U+10FFFF
+    if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+            (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+        return 0;
+    }
+    return len;
+}
+
+// Writes `s` as the body of a JSON string; needs up to 6 bytes per input
+// byte. Bytes that are not valid UTF-8 become \u00XX escapes so that the
+// stream stays parseable.
+size_t json_escape(char *dst, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)s;
+    char *d = dst;
+    while (*p) {
+        size_t n = utf8_sequence(p);
+        if (*p == '"' || *p == '\\') {
+            *d++ = '\\';
+            *d++ = *p++;
+        } else if (n == 0 || *p < 0x20) {
+            memcpy(d, "\\u00", 4);
+            d[4] = hex[*p >> 4];
+            d[5] = hex[*p & 0xf];
+            d += 6;
+            p++;
+        } else {
+            memcpy(d, p, n);
+            d += n;
+            p += n;
+        }
+    }
+    return d - dst;
+}
+
+typedef enum {
+    EV_ROOT,
+    EV_SCAN,
+    EV_EXCLUDED,
+    EV_OTHER_FS,
+    EV_DENIED,
+    EV_VISITED,
+    EV_DELETED,
+    EV_WOULD_DELETE,
+    EV_STAT_ERROR,
+    EV_UNLINK_ERROR,
+    EV_OPEN_ERROR,
+    EV_READ_ERROR,
+} OutEvent;
+
+// Text prefix (or, for errors, the stderr format) and JSON fields of each
+// event.
+static const struct {
+    const char *text;
+    const char *json;
+} out_events[] = {
+    [EV_ROOT] = {NULL, "\"root\""},
+    [EV_SCAN] = {"Scanning: ", "\"scan\""},
+    [EV_EXCLUDED] = {"Skipping (excluded): ",
+            "\"skip\",\"reason\":\"excluded\""},
+    [EV_OTHER_FS] = {"Skipping (different filesystem): ",
+            "\"skip\",\"reason\":\"other_filesystem\""},
+    [EV_DENIED] = {"Skipping (Access Denied): ",
+            "\"skip\",\"reason\":\"access_denied\""},
+    [EV_VISITED] = {"Skipping (already scanned): ",
+            "\"skip\",\"reason\":\"already_scanned\""},
+    [EV_DELETED] = {"Deleted: ", "\"deleted\""},
+    [EV_WOULD_DELETE] = {"(dry-run) Would delete: ", "\"would_delete\""},
+    [EV_STAT_ERROR] = {"Error stating '%s': %s\n",
+            "\"error\",\"op\":\"stat\""},
+    [EV_UNLINK_ERROR] = {"Error deleting '%s': %s\n",
+            "\"error\",\"op\":\"unlink\""},
+    [EV_OPEN_ERROR] = {"Error opening directory '%s': %s\n",
+            "\"error\",\"op\":\"open\""},
+    [EV_READ_ERROR] = {"Error reading directory '%s': %s\n",
+            "\"error\",\"op\":\"read\""},
+};
+
+// Reports an event about `path`. Errors (`err` set) go to stderr except
+// in JSON mode, where every event is a line of the stdout stream; with
+// --print0 only the paths of deleted files are written.
+void emit(Worker *w, OutEvent ev, const char *path, int err)
+{
+    OutputMode mode = w->pool->opts->output;
+    size_t len = strlen(path);
+    char *p;
+
+    if (mode != OUTPUT_JSON && ev >= EV_STAT_ERROR) {
+        if (w->pool->opts->progress) {
+            pthread_mutex_lock(&w->pool->out.lock);
+            out_clear_progress(&w->pool->out);
+            fprintf(stderr, out_events[ev].text, path, strerror(err));
+            pthread_mutex_unlock(&w->pool->out.lock);
+        } else {
+            fprintf(stderr, out_events[ev].text, path, strerror(err));
+        }
+        return;
+    }
+    switch (mode) {
+    case OUTPUT_TEXT: {
+        if (!out_events[ev].text) {
+            return;
+        }
+        size_t prefix = strlen(out_events[ev].text);
+        if ((p = out_reserve(w, prefix + len + 1))) {
+            memcpy(p, out_events[ev].text, prefix);
+            memcpy(p + prefix, path, len);
+            p[prefix + len] = '\n';
+            out_commit(w, prefix + len + 1);
+        }
+        break;
+    }
+    case OUTPUT_PRINT0:
+        if (ev != EV_DELETED && ev != EV_WOULD_DELETE) {
+            return;
+        }
+        if ((p = out_reserve(w, len + 1))) {
+            memcpy(p, path, len + 1);
+            out_commit(w, len + 1);
+        }
+        break;
+    case OUTPUT_JSON: {
+        const char *msg = err ? strerror(err) : "";
+        size_t bound = 64 + strlen(out_events[ev].json) + 6 * len +
+                6 * strlen(msg);
+        if (!(p = out_reserve(w, bound))) {
+            return;
+        }
+        char *d = p;
+        d += sprintf(d, "{\"event\":%s,\"path\":\"", out_events[ev].json);
+        d += json_escape(d, path);
+        *d++ = '"';
+        if (err) {
+            d += sprintf(d, ",\"errno\":%d,\"error\":\"", err);
+            d += json_escape(d, msg);
+            *d++ = '"';
+        }
+        *d++ = '}';
+        *d++ = '\n';
+        out_commit(w, d - p);
+        break;
+    }
+    }
+}
+
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+
+// Opens directory `name` relative to `parent_fd`. Only the starting paths
+// given on the command line are allowed to be symlinks.
+int open_dir_at(int parent_fd, const char *name, bool follow)
+{
+    // O_NOATIME is refused with EPERM on files we do not own; stop asking
+    // for it after the first refusal.
+    static atomic_int noatime = O_NOATIME;
+
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW);
+    int extra = atomic_load_explicit(&noatime, memory_order_relaxed);
+    int fd = openat(parent_fd, name, flags | extra);
+    if (fd == -1 && errno == EPERM && extra) {
+        atomic_store_explicit(&noatime, 0, memory_order_relaxed);
+        fd = openat(parent_fd, name, flags);
+    }
+    return fd;
+}
+
+// Directory reading engines. The getdents engine issues raw getdents64
+// calls into the worker's reusable buffer and walks the records in place,
+// so no per-directory allocation takes place; readdir is the portable
+// fallback.
+#ifdef __linux__
+#define DEFAULT_READER READER_GETDENTS
+#else
+#define DEFAULT_READER READER_READDIR
+#endif
+
+#ifdef DT_UNKNOWN
+#define HAVE_D_TYPE 1
+#else
+// No d_type on this platform: every entry is reported as DT_UNKNOWN.
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_LNK 10
+#endif
+
+typedef struct {
+    const char *name;
+    unsigned char type;
+    ino_t ino;
+} DirEntry;
+
+typedef struct {
+    ReaderKind kind;
+    Worker *worker;
+    int fd;
+    DIR *dir;
+    size_t pos;
+    size_t len;
+    bool sized;
+} DirReader;
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define GETDENTS_MIN_BUF (32 * 1024)
+#define GETDENTS_MAX_BUF (4 * 1024 * 1024)
+
+// Refills the worker's buffer. A directory whose first read fills most of
+// it gets the buffer grown to its st_size, so big directories are read in
+// a few large calls; the buffer is kept for every later directory.
+bool getdents_fill(DirReader *r)
+{
+    Worker *w = r->worker;
+    if (!w->read_buf) {
+        w->read_buf = counted_malloc(GETDENTS_MIN_BUF);
+        if (!w->read_buf) {
+            return false;
+        }
+        w->read_cap = GETDENTS_MIN_BUF;
+    }
+
+    long n = syscall(SYS_getdents64, r->fd, w->read_buf, w->read_cap);
+    if (n <= 0) {
+        if (n == 0) {
+            errno = 0;
+        }
+        return false;
+    }
+    r->pos = 0;
+    r->len = (size_t)n;
+
+    struct stat st;
+    if (!r->sized && r->len > w->read_cap / 2 && fstat(r->fd, &st) == 0) {
+        size_t want = st.st_size > GETDENTS_MAX_BUF ? GETDENTS_MAX_BUF
+                                                    : (size_t)st.st_size;
+        if (want > w->read_cap) {
+            char *grown = counted_realloc(w->read_buf, want);
+            if (grown) {
+                w->read_buf = grown;
+                w->read_cap = want;
+            }
+        }
+    }
+    r->sized = true;
+    return true;
+}
+#endif
+
+// Starts reading the directory open on `fd`. With the readdir engine the
+// descriptor then belongs to r->dir.
+bool dir_reader_open(DirReader *r, Worker *w, int fd, ReaderKind kind)
+{
+    *r = (DirReader){.kind = kind, .worker = w, .fd = fd};
+    if (kind == READER_READDIR) {
+        // libc allocates the DIR and its buffer
+        thread_allocs++;
+        r->dir = fdopendir(fd);
+        return r->dir != NULL;
+    }
+    return true;
+}
+
+// Fetches the next entry. Returns false at the end of the directory, or
+// on error with errno set.
+bool dir_reader_next(DirReader *r, DirEntry *e)
+{
+#ifdef __linux__
+    if (r->kind == READER_GETDENTS) {
+        if (r->pos >= r->len && !getdents_fill(r)) {
+            return false;
+        }
+        struct linux_dirent64 *d = (void *)(r->worker->read_buf + r->pos);
+        r->pos += d->d_reclen;
+        e->name = d->d_name;
+        e->type = d->d_type;
+        e->ino = (ino_t)d->d_ino;
+        return true;
+    }
+#endif
+    errno = 0;
+    struct dirent *ent = readdir(r->dir);
+    if (!ent) {
+        return false;
+    }
+    e->name = ent->d_name;
+#ifdef HAVE_D_TYPE
+    e->type = ent->d_type;
+#else
+    e->type = DT_UNKNOWN;
+#endif
+    e->ino = ent->d_ino;
+    return true;
+}
+
+// Takes a chunk off the spare list, or allocates a new one.
+ArenaChunk *arena_chunk_get(NodeArena *a)
+{
+    pthread_mutex_lock(&a->lock);
+    ArenaChunk *c = a->spare;
+    if (c) {
+        a->spare = c->next;
+        a->spare_count--;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (!c) {
+        thread_allocs++;
+        c = aligned_alloc(ARENA_CHUNK_SIZE, ARENA_CHUNK_SIZE);
+        if (!c) {
+            return NULL;
+        }
+        c->arena = a;
+    }
+    atomic_init(&c->live, 1);
+    c->used = (sizeof(*c) + 15) & ~(size_t)15;
+    return c;
+}
+
+// Drops a reference on a chunk, recycling it after the last one. Beyond
+// ARENA_SPARE_MAX spares (4 MiB) chunks go back to the heap, so a
+// long-running --watch does not hold on to its peak forever.
+void arena_chunk_put(ArenaChunk *c)
+{
+    if (atomic_fetch_sub(&c->live, 1) != 1) {
+        return;
+    }
+    NodeArena *a = c->arena;
+    pthread_mutex_lock(&a->lock);
+    if (a->spare_count < ARENA_SPARE_MAX) {
+        c->next = a->spare;
+        a->spare = c;
+        a->spare_count++;
+        c = NULL;
+    }
+    pthread_mutex_unlock(&a->lock);
+    free(c);
+}
+
+void *arena_alloc(Worker *w, size_t size)
+{
+    NodeArena *a = &w->arena;
+    size = (size + 15) & ~(size_t)15;
+    ArenaChunk *c = a->current;
+    if (!c || c->used + size > ARENA_CHUNK_SIZE) {
+        if (c) {
+            arena_chunk_put(c);
+        }
+        a->current = c = arena_chunk_get(a);
+        if (!c) {
+            return NULL;
+        }
+    }
+    void *p = (char *)c + c->used;
+    c->used += size;
+    atomic_fetch_add(&c->live, 1);
+    return p;
+}
+
+void arena_free(void *p)
+{
+    arena_chunk_put(
+            (ArenaChunk *)((uintptr_t)p & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1)));
+}
+
+void arena_destroy(NodeArena *a)
+{
+    if (a->current) {
+        arena_chunk_put(a->current);
+        a->current = NULL;
+    }
+    while (a->spare) {
+        ArenaChunk *c = a->spare;
+        a->spare = c->next;
+        free(c);
+    }
+    a->spare_count = 0;
+    pthread_mutex_destroy(&a->lock);
+}
+
+DirNode *node_new(Worker *w, DirNode *parent, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    DirNode *node = arena_alloc(w, sizeof(*node) + len);
+    if (!node) {
+        return NULL;
+    }
+    node->parent = parent;
+    atomic_init(&node->refs, 1);
+    atomic_init(&node->fd_refs, 0);
+    node->fd = -1;
+    node->dir = NULL;
+    node->depth = parent ? parent->depth + 1 : 0;
+    node->root_dev = parent ? parent->root_dev : 0;
+    node->dev = 0;
+    node->ino = 0;
+    node->dirty = false;
+    node->follow = false;
+    node->wd = -1;
+    atomic_init(&node->scanned, false);
+    atomic_init(&node->deletes, 0);
+    node->parked_ino = 0;
+    memcpy(node->name, name, len);
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+        atomic_fetch_add(&parent->fd_refs, 1);
+    }
+    return node;
+}
+
+// Drops a memory reference, freeing the node and any ancestors that are
+// no longer referenced.
+void node_release(DirNode *node)
+{
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1) {
+        DirNode *parent = node->parent;
+        arena_free(node);
+        node = parent;
+    }
+}
+
+// Drops a descriptor reference, closing the directory after the last one.
+void node_release_fd(DirNode *node)
+{
+    if (fd_budget) {
+        pthread_rwlock_rdlock(&park_lock);
+    }
+    if (atomic_fetch_sub(&node->fd_refs, 1) == 1 && node->fd != -1) {
+        if (node->dir) {
+            closedir(node->dir);
+        } else {
+            close(node->fd);
+        }
+        node->dir = NULL;
+        node->fd = -1;
+        if (fd_budget) {
+            atomic_fetch_sub(&open_dirs, 1);
+        }
+    }
+    if (fd_budget) {
+        pthread_rwlock_unlock(&park_lock);
+    }
+}
+
+// Closes the descriptor of a scanned directory whose subdirectories are
+// still to be opened, remembering its identity. park_lock must be held
+// for writing.
+bool node_park(Worker *w, DirNode *node)
+{
+    struct stat st;
+    if (fstat(node->fd, &st) == -1) {
+        return false;
+    }
+    node->dev = st.st_dev;
+    node->parked_ino = st.st_ino;
+    if (node->dir) {
+        closedir(node->dir);
+    } else {
+        close(node->fd);
+    }
+    node->dir = NULL;
+    node->fd = -1;
+    atomic_fetch_sub(&open_dirs, 1);
+    w->counters.dirs_parked++;
+    return true;
+}
+
+// Parks directories on the chain from `node` up, root-most first since
+// those are needed again last, until three quarters of the budget are in
+// use (or, with `all`, every one that can be). Only directories whose own
+// scan is over and that have no deletions queued qualify.
+void park_ancestors(Worker *w, DirNode *node, bool all)
+{
+    pthread_rwlock_wrlock(&park_lock);
+    size_t count = 0;
+    for (DirNode *n = node; n; n = n->parent) {
+        if (n->fd == -1 || !atomic_load(&n->scanned) ||
+                atomic_load(&n->deletes) > 0) {
+            continue;
+        }
+        if (count == w->park_cap) {
+            size_t cap = w->park_cap ? w->park_cap * 2 : 64;
+            DirNode **buf =
+                    counted_realloc(w->park_buf, cap * sizeof(*buf));
+            if (!buf) {
+                break;
+            }
+            w->park_buf = buf;
+            w->park_cap = cap;
+        }
+        w->park_buf[count++] = n;
+    }
+    int low = fd_budget - fd_budget / 4;
+    while (count > 0 && (all || atomic_load(&open_dirs) > low)) {
+        node_park(w, w->park_buf[--count]);
+    }
+    pthread_rwlock_unlock(&park_lock);
+}
+
+// Reopens a parked directory with one openat() of the path from its
+// nearest open ancestor (a few, for paths beyond PATH_MAX) and checks it
+// is still the same directory. park_lock must be held for writing.
+bool node_reopen(Worker *w, DirNode *node)
+{
+    size_t count = 1;
+    DirNode *top = node;
+    while (top->parent && top->parent->fd == -1) {
+        top = top->parent;
+        count++;
+    }
+    DirNode **chain = counted_malloc(count * sizeof(*chain));
+    if (!chain) {
+        return false;
+    }
+    DirNode *n = node;
+    for (size_t i = count; i-- > 0; n = n->parent) {
+        chain[i] = n;
+    }
+
+    int base = top->parent ? top->parent->fd : AT_FDCWD;
+    int fd = base;
+    char path[PATH_MAX];
+    size_t len = 0;
+    for (size_t i = 0; i <= count && fd != -1; i++) {
+        size_t name_len = i < count ? strlen(chain[i]->name) : 0;
+        if (name_len >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            fd = -1;
+            break;
+        }
+        if (len > 0 && (i == count || len + 1 + name_len >= PATH_MAX)) {
+            int next = openat(fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            int err = errno;
+            if (fd != base) {
+                close(fd);
+            }
+            fd = next;
+            errno = err;
+            len = 0;
+        }
+        if (i < count) {
+            if (len > 0) {
+                path[len++] = '/';
+            }
+            memcpy(path + len, chain[i]->name, name_len + 1);
+            len += name_len;
+        }
+    }
+    free(chain);
+
+    struct stat st;
+    if (fd != -1 && (fstat(fd, &st) == -1 || st.st_dev != node->dev ||
+                            st.st_ino != node->parked_ino)) {
+        // Renamed or replaced while parked
+        close(fd);
+        errno = ESTALE;
+        fd = -1;
+    }
+    if (fd == -1) {
+        return false;
+    }
+    node->fd = fd;
+    atomic_fetch_add(&open_dirs, 1);
+    w->counters.dirs_reopened++;
+    return true;
+}
+
+bool deque_push(Deque *d, DirNode *node)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    (d->tail - d->head) * sizeof(*d->items));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t cap = d->cap ? d->cap * 2 : 64;
+            DirNode **grown = counted_realloc(d->items, cap * sizeof(*grown));
+            if (!grown) {
+                pthread_mutex_unlock(&d->lock);
+                return false;
+            }
+            d->items = grown;
+            d->cap = cap;
+        }
+    }
+    d->items[d->tail++] = node;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+// Takes the newest node (owner side) or the oldest one (thief side).
+DirNode *deque_take(Deque *d, bool steal)
+{
+    DirNode *node = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        node = steal ? d->items[d->head++] : d->items[--d->tail];
+        if (d->head == d->tail) {
+            d->head = d->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return node;
+}
+
+// Queues a directory on the worker's own deque and wakes an idle worker.
+bool pool_push(Worker *w, DirNode *node)
+{
+    Pool *pool = w->pool;
+    atomic_fetch_add(&pool->pending, 1);
+    if (!deque_push(&w->deque, node)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return false;
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return true;
+}
+
+// Bounded multi-producer/multi-consumer queue of pending deletions, used
+// when --delete-workers splits deletion off the scan. Each cell carries a
+// sequence number that says whether it is free for the producer at that
+// position or filled for the consumer, so both sides only CAS their own
+// index. A queued deletion holds a reference on its directory and on the
+// directory's descriptor until it has been carried out.
+#define DELETE_QUEUE_SIZE 4096
+
+typedef struct {
+    atomic_size_t seq;
+    DirNode *node;
+    uint64_t bytes;
+    char name[NAME_MAX + 1];
+} DeleteCell;
+
+struct DeleteQueue {
+    DeleteCell cells[DELETE_QUEUE_SIZE];
+    alignas(64) atomic_size_t head; // next position to fill
+    alignas(64) atomic_size_t tail; // next position to drain
+    atomic_bool closed;
+};
+
+DeleteQueue *delete_queue_new(void)
+{
+    DeleteQueue *q = malloc(sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    for (size_t i = 0; i < DELETE_QUEUE_SIZE; i++) {
+        atomic_init(&q->cells[i].seq, i);
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->closed, false);
+    return q;
+}
+
+bool delete_queue_try_push(
+        DeleteQueue *q, DirNode *node, const char *name, uint64_t bytes)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        DeleteCell *cell = &q->cells[pos % DELETE_QUEUE_SIZE];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                cell->node = node;
+                cell->bytes = bytes;
+                snprintf(cell->name, sizeof(cell->name), "%s", name);
+                atomic_store_explicit(
+                        &cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Takes the oldest deletion, copying its name into `name`.
+DirNode *delete_queue_try_pop(DeleteQueue *q, char *name, uint64_t *bytes)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        DeleteCell *cell = &q->cells[pos % DELETE_QUEUE_SIZE];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                DirNode *node = cell->node;
+                memcpy(name, cell->name, NAME_MAX + 1);
+                *bytes = cell->bytes;
+                atomic_store_explicit(&cell->seq, pos + DELETE_QUEUE_SIZE,
+                        memory_order_release);
+                return node;
+            }
+        } else if (diff < 0) {
+            return NULL; // empty
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Waits a little longer each time a queue stays full or empty.
+void backoff(unsigned *round)
+{
+    if (*round < 16) {
+        sched_yield();
+    } else {
+        unsigned shift = *round - 16 < 10 ? *round - 16 : 10;
+        struct timespec ts = {0, 1000L << shift}; // up to ~1ms
+        nanosleep(&ts, NULL);
+    }
+    (*round)++;
+}
+
+// Hands a deletion to the deletion workers, blocking while the queue is
+// full so a slow filesystem holds the scan back instead of growing memory.
+void delete_queue_push(
+        DeleteQueue *q, DirNode *node, const char *name, uint64_t bytes)
+{
+    atomic_fetch_add(&node->refs, 1);
+    atomic_fetch_add(&node->fd_refs, 1);
+    atomic_fetch_add(&node->deletes, 1);
+    unsigned round = 0;
+    while (!delete_queue_try_push(q, node, name, bytes)) {
+        backoff(&round);
+    }
+}
+
+// Directories already scanned, by (dev, ino), so overlapping starting
+// paths and -L never read a directory twice. Keys are spread over
+// independently locked shards, each an open-addressing table that
+// doubles at half load; the shard comes from the top bits of the hash
+// and the slot from the bottom ones. An all-zero key marks a free slot,
+// which no real directory has.
+#define VISITED_SHARDS 64
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} VisitedKey;
+
+typedef struct {
+    alignas(64) pthread_mutex_t lock;
+    VisitedKey *slots;
+    size_t count;
+    size_t cap;
+} VisitedShard;
+
+struct VisitedSet {
+    VisitedShard shards[VISITED_SHARDS];
+};
+
+VisitedSet *visited_new(void)
+{
+    VisitedSet *set = calloc(1, sizeof(*set));
+    if (!set) {
+        return NULL;
+    }
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+    }
+    return set;
+}
+
+// splitmix64 finaliser
+uint64_t visited_hash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+VisitedKey *visited_slot(VisitedKey *slots, size_t cap, uint64_t hash,
+        uint64_t dev, uint64_t ino)
+{
+    size_t i = hash & (cap - 1);
+    while ((slots[i].dev || slots[i].ino) &&
+            (slots[i].dev != dev || slots[i].ino != ino)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+// Adds a directory. Returns false if it was already there (or, so that
+// nothing is skipped by mistake, true when memory runs out).
+bool visited_insert(VisitedSet *set, uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = visited_hash(dev, ino);
+    VisitedShard *s = &set->shards[hash >> 58];
+    pthread_mutex_lock(&s->lock);
+    if (2 * (s->count + 1) > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        VisitedKey *slots = counted_calloc(cap, sizeof(*slots));
+        if (!slots) {
+            pthread_mutex_unlock(&s->lock);
+            return true;
+        }
+        for (size_t i = 0; i < s->cap; i++) {
+            VisitedKey *k = &s->slots[i];
+            if (k->dev || k->ino) {
+                *visited_slot(slots, cap, visited_hash(k->dev, k->ino),
+                        k->dev, k->ino) = *k;
+            }
+        }
+        free(s->slots);
+        s->slots = slots;
+        s->cap = cap;
+    }
+    VisitedKey *slot = visited_slot(s->slots, s->cap, hash, dev, ino);
+    bool added = !slot->dev && !slot->ino;
+    if (added) {
+        *slot = (VisitedKey){dev, ino};
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return added;
+}
+
+// Forgets every directory, for a watch batch or rescan that must see
+// directories again (and inodes that have since been reused).
+void visited_clear(VisitedSet *set)
+{
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        VisitedShard *s = &set->shards[i];
+        if (s->count) {
+            memset(s->slots, 0, s->cap * sizeof(*s->slots));
+            s->count = 0;
+        }
+    }
+}
+
+void visited_free(VisitedSet *set)
+{
+    if (!set) {
+        return;
+    }
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        pthread_mutex_destroy(&set->shards[i].lock);
+        free(set->shards[i].slots);
+    }
+    free(set);
+}
+
+uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// I/O throttle (--max-ops-per-sec, --max-dirs-per-sec), shared by every
+// thread. Each limit is a token bucket in GCRA form: one atomic holds the
+// time by which everything taken so far is paid for, and taking a token
+// moves it on by one interval with a CAS. A thread that gets more than
+// THROTTLE_BURST_NS ahead of the clock sleeps off the difference, so
+// idle time builds up at most that much credit. Without a limit the
+// interval is zero and the atomic is never touched.
+#define THROTTLE_BURST_NS 100000000ull
+
+typedef struct {
+    _Atomic uint64_t tat;
+    uint64_t interval; // ns per operation
+} RateLimit;
+
+static RateLimit ops_limit;
+static RateLimit dirs_limit;
+
+void throttle(Worker *w, RateLimit *rl)
+{
+    if (!rl->interval) {
+        return;
+    }
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    uint64_t tat = atomic_load_explicit(&rl->tat, memory_order_relaxed);
+    uint64_t due;
+    do {
+        due = tat > now ? tat : now;
+    } while (!atomic_compare_exchange_weak_explicit(&rl->tat, &tat,
+            due + rl->interval, memory_order_relaxed, memory_order_relaxed));
+    if (due > now + THROTTLE_BURST_NS) {
+        uint64_t wait = due - THROTTLE_BURST_NS - now;
+        struct timespec ts = {wait / 1000000000u, wait % 1000000000u};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+        w->counters.throttled++;
+        w->counters.throttle_ns += wait;
+    }
+}
+
+// --idle: move the whole process, and so every thread created after this,
+// into the idle I/O and CPU classes, where it only gets the disk and
+// processors when nothing else wants them. Where those classes do not
+// exist the nearest thing is used. Failure is only a warning, since the
+// run itself is still correct.
+void set_idle_priority(void)
+{
+#ifdef __linux__
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#endif
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        fprintf(stderr, "Warning: cannot set idle I/O priority: %s\n",
+                strerror(errno));
+    }
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == -1) {
+        fprintf(stderr, "Warning: cannot set idle CPU scheduling: %s\n",
+                strerror(errno));
+    }
+#elif defined(__APPLE__)
+    // Background policy throttles both disk and CPU
+    if (setpriority(PRIO_DARWIN_PROCESS, 0, PRIO_DARWIN_BG) == -1) {
+        fprintf(stderr, "Warning: cannot set background priority: %s\n",
+                strerror(errno));
+    }
+#else
+    if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+        fprintf(stderr, "Warning: cannot lower priority: %s\n",
+                strerror(errno));
+    }
+#endif
+}
+
+// --stats splits each worker's time between the readdir, stat and unlink
+// phases. Stat and unlink calls are timed where they are made (with
+// io_uring per submit-and-reap, shared out by completion); the rest of a
+// span of work, a directory or a batch of deletions, counts towards its
+// main phase. Thread CPU time is sampled once per span and divided in the
+// same proportions as the wall time.
+void span_begin(Worker *w)
+{
+    if (w->pool->opts->stats == STATS_OFF) {
+        return;
+    }
+    memset(w->span_ns, 0, sizeof(w->span_ns));
+    w->span_wall = clock_ns(CLOCK_MONOTONIC);
+    w->span_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void span_end(Worker *w, Phase rest)
+{
+    if (w->pool->opts->stats == STATS_OFF) {
+        return;
+    }
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - w->span_wall;
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - w->span_cpu;
+    uint64_t timed = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (p != (int)rest) {
+            timed += w->span_ns[p];
+        }
+    }
+    w->span_ns[rest] = wall > timed ? wall - timed : 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        w->counters.wall_ns[p] += w->span_ns[p];
+        if (wall > 0) {
+            w->counters.cpu_ns[p] +=
+                    (uint64_t)((double)cpu * w->span_ns[p] / wall);
+        }
+    }
+}
+
+// Start time for phase_end(), or 0 without --stats.
+uint64_t phase_start(Worker *w)
+{
+    return w->pool->opts->stats != STATS_OFF ? clock_ns(CLOCK_MONOTONIC) : 0;
+}
+
+void phase_end(Worker *w, Phase phase, uint64_t start)
+{
+    if (start) {
+        w->span_ns[phase] += clock_ns(CLOCK_MONOTONIC) - start;
+    }
+}
+
+void count_error(Worker *w, int err)
+{
+    w->counters.errors[err > 0 && err < ERRNO_SLOTS ? err : ERRNO_SLOTS - 1]++;
+    w->counters.error_count++;
+}
+
+#ifdef __APPLE__
+#define ST_MTIM st_mtimespec
+#define ST_CTIM st_ctimespec
+#else
+#define ST_MTIM st_mtim
+#define ST_CTIM st_ctim
+#endif
+
+// Incremental scans. A directory's mtime changes whenever an entry is
+// added, removed or renamed in it, so a directory that held no targets
+// last time and still has the same mtime holds none now either. Such a
+// directory is opened (its subdirectories are opened relative to it) but
+// not read: its subdirectories are replayed from the cache instead.
+// Directories modified within a second or so of the run starting are not
+// recorded, since a change in the same timestamp tick would go unseen.
+// Directories that could not be opened for lack of permission are kept
+// too, keyed by the parent's device and their inode, and skipped quietly
+// while their ctime (which a permission change updates) stays the same.
+
+// Folds everything that decides what counts as a target into one value.
+// Changing the targets invalidates the cache.
+uint64_t cache_config_hash(const Options *opts)
+{
+    // Sum of per-item FNV-1a hashes, so the order of options is irrelevant
+    uint64_t sum = opts->clean_all + 2 * opts->follow;
+    for (size_t i = 0; i < opts->targets.count; i++) {
+        uint64_t h = 14695981039346656037ull;
+        for (const char *p = opts->targets.names[i]; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+        }
+        sum += h;
+    }
+    for (int i = 0; i < opts->globs.pattern_count; i++) {
+        if (!(opts->globs.pattern_tags[i] & GLOB_TARGET)) {
+            continue;
+        }
+        uint64_t h = 14695981039346656037ull ^ 0xff;
+        for (const char *p = opts->globs.patterns[i]; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+        }
+        sum += h;
+    }
+    return sum;
+}
+
+// Maps the cache left by the previous run. A missing file is an empty
+// cache; one written for other targets or damaged is ignored.
+bool cache_load(CacheFile *c, const char *path, uint64_t config_hash)
+{
+    *c = (CacheFile){.path = path, .config_hash = config_hash,
+            .cutoff = (int64_t)time(NULL) - 1};
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "Error opening cache '%s': %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return true;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return true;
+    }
+
+    const CacheHeader *h = map;
+    const char *base = map;
+    size_t records_len = (size_t)h->record_count * sizeof(CacheRecord);
+    size_t subdirs_len = h->subdir_count * sizeof(CacheSubdir);
+    if (memcmp(h->magic, CACHE_MAGIC, 8) != 0 ||
+            h->version != CACHE_VERSION || h->config_hash != config_hash ||
+            h->subdir_count > (uint64_t)st.st_size ||
+            h->names_len > (uint64_t)st.st_size ||
+            sizeof(*h) + records_len + subdirs_len + h->names_len !=
+                    (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return true;
+    }
+    c->map = map;
+    c->map_len = st.st_size;
+    c->records = (const CacheRecord *)(base + sizeof(*h));
+    c->record_count = h->record_count;
+    c->subdirs = (const CacheSubdir *)(base + sizeof(*h) + records_len);
+    c->subdir_count = h->subdir_count;
+    c->names = base + sizeof(*h) + records_len + subdirs_len;
+    c->names_len = h->names_len;
+    return true;
+}
+
+const CacheRecord *cache_find(const CacheFile *c, uint64_t dev, uint64_t ino)
+{
+    size_t lo = 0;
+    size_t hi = c->record_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const CacheRecord *r = &c->records[mid];
+        if (r->dev < dev || (r->dev == dev && r->ino < ino)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < c->record_count && c->records[lo].dev == dev &&
+            c->records[lo].ino == ino) {
+        return &c->records[lo];
+    }
+    return NULL;
+}
+
+// Makes room for `extra` more elements of `size` bytes.
+bool cache_reserve(void **items, size_t *cap, size_t count, size_t extra,
+        size_t size)
+{
+    if (count + extra <= *cap) {
+        return true;
+    }
+    size_t grown = *cap ? *cap * 2 : 256;
+    while (grown < count + extra) {
+        grown *= 2;
+    }
+    void *p = counted_realloc(*items, grown * size);
+    if (!p) {
+        return false;
+    }
+    *items = p;
+    *cap = grown;
+    return true;
+}
+
+void cache_add_subdir(Worker *w, const char *name, uint64_t ino)
+{
+    CacheBuilder *b = &w->cache;
+    size_t len = strlen(name);
+    if (!cache_reserve((void **)&b->subdirs, &b->subdir_cap, b->subdir_count,
+                1, sizeof(CacheSubdir)) ||
+            !cache_reserve((void **)&b->names, &b->names_cap, b->names_len,
+                    len + 1, 1)) {
+        b->failed = true;
+        return;
+    }
+    b->subdirs[b->subdir_count++] = (CacheSubdir){
+            .ino = ino, .name_offset = b->names_len, .name_len = len};
+    memcpy(b->names + b->names_len, name, len + 1);
+    b->names_len += len + 1;
+}
+
+void cache_add_record(Worker *w, const CacheRecord *rec)
+{
+    CacheBuilder *b = &w->cache;
+    if (!cache_reserve((void **)&b->records, &b->cap, b->count, 1,
+                sizeof(CacheRecord))) {
+        b->failed = true;
+        return;
+    }
+    b->records[b->count++] = *rec;
+}
+
+// Skips a directory that was denied last time and has not changed since,
+// carrying its record over to the next cache.
+bool cache_skip_denied(Worker *w, DirNode *node)
+{
+    const CacheFile *c = &w->pool->opts->cache;
+    DirNode *parent = node->parent;
+    if (!parent || !node->ino) {
+        return false;
+    }
+    const CacheRecord *rec = cache_find(c, parent->dev, node->ino);
+    struct stat st;
+    if (!rec || !(rec->flags & CACHE_DENIED) ||
+            fstatat(parent->fd, node->name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            st.ST_CTIM.tv_sec != rec->time_sec ||
+            (uint32_t)st.ST_CTIM.tv_nsec != rec->time_nsec) {
+        return false;
+    }
+    w->counters.denied_cached++;
+    cache_add_record(w, rec);
+    return true;
+}
+
+// Returns the record of a directory that held nothing to do when it was
+// last read and has not been modified since.
+const CacheRecord *cache_lookup_clean(const CacheFile *c, const struct stat *st)
+{
+    const CacheRecord *rec = cache_find(c, st->st_dev, st->st_ino);
+    if (!rec || !(rec->flags & CACHE_CLEAN) ||
+            rec->time_sec != st->ST_MTIM.tv_sec ||
+            rec->time_nsec != (uint32_t)st->ST_MTIM.tv_nsec ||
+            rec->subdir_first > c->subdir_count ||
+            rec->subdir_count > c->subdir_count - rec->subdir_first) {
+        return NULL;
+    }
+    // The names are handed out as C strings, so check them first
+    for (uint32_t i = 0; i < rec->subdir_count; i++) {
+        const CacheSubdir *sd = &c->subdirs[rec->subdir_first + i];
+        if (sd->name_offset >= c->names_len ||
+                sd->name_len >= c->names_len - sd->name_offset ||
+                c->names[sd->name_offset + sd->name_len] != '\0') {
+            return NULL;
+        }
+    }
+    return rec;
+}
+
+// Keeps the record of a directory just handled if it held nothing to do,
+// or drops the subdirectories noted for it otherwise.
+void cache_finish_dir(Worker *w, DirNode *node, const struct stat *st,
+        bool complete, size_t subdir_mark, size_t names_mark)
+{
+    CacheBuilder *b = &w->cache;
+    if (!st || !complete || node->dirty ||
+            st->ST_MTIM.tv_sec >= w->pool->opts->cache.cutoff) {
+        b->subdir_count = subdir_mark;
+        b->names_len = names_mark;
+        return;
+    }
+    cache_add_record(w, &(CacheRecord){.dev = st->st_dev,
+                                .ino = st->st_ino,
+                                .time_sec = st->ST_MTIM.tv_sec,
+                                .time_nsec = st->ST_MTIM.tv_nsec,
+                                .flags = CACHE_CLEAN,
+                                .subdir_first = subdir_mark,
+                                .subdir_count = b->subdir_count - subdir_mark});
+}
+
+void cache_note_denied(Worker *w, DirNode *node)
+{
+    DirNode *parent = node->parent;
+    struct stat st;
+    if (!parent || !node->ino ||
+            fstatat(parent->fd, node->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return;
+    }
+    cache_add_record(w, &(CacheRecord){.dev = parent->dev,
+                                .ino = node->ino,
+                                .time_sec = st.ST_CTIM.tv_sec,
+                                .time_nsec = st.ST_CTIM.tv_nsec,
+                                .flags = CACHE_DENIED});
+}
+
+int cmp_cache_record(const void *a, const void *b)
+{
+    const CacheRecord *x = a;
+    const CacheRecord *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+bool write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writes `parts` to a temporary file next to `path` and renames it over
+// `path`, so readers see the old file or the new one, never a mix. Sets
+// errno on failure.
+bool replace_file(const char *path, const struct iovec *parts, int count)
+{
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = malloc(tmp_len);
+    if (!tmp) {
+        return false;
+    }
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    bool ok = fd != -1;
+    for (int i = 0; ok && i < count; i++) {
+        ok = write_all(fd, parts[i].iov_base, parts[i].iov_len);
+    }
+    int saved = errno;
+    if (fd != -1 && close(fd) == -1 && ok) {
+        ok = false;
+        saved = errno;
+    }
+    if (ok && rename(tmp, path) == -1) {
+        ok = false;
+        saved = errno;
+    }
+    if (!ok && fd != -1) {
+        unlink(tmp);
+    }
+    free(tmp);
+    errno = saved;
+    return ok;
+}
+
+// Merges the workers' records into a new cache file, which replaces the
+// old one atomically.
+bool cache_save(Pool *pool, const CacheFile *c)
+{
+    size_t count = 0;
+    size_t subdir_count = 0;
+    size_t names_len = 0;
+    for (int i = 0; i < pool->count; i++) {
+        CacheBuilder *b = &pool->workers[i].cache;
+        if (b->failed) {
+            fprintf(stderr, "Memory allocation failed for the cache.\n");
+            return false;
+        }
+        count += b->count;
+        subdir_count += b->subdir_count;
+        names_len += b->names_len;
+    }
+    if (count > UINT32_MAX || subdir_count > UINT32_MAX ||
+            names_len > UINT32_MAX) {
+        fprintf(stderr, "Too many directories for the cache.\n");
+        return false;
+    }
+
+    CacheRecord *records = malloc((count ? count : 1) * sizeof(*records));
+    CacheSubdir *subdirs =
+            malloc((subdir_count ? subdir_count : 1) * sizeof(*subdirs));
+    char *names = malloc(names_len ? names_len : 1);
+    if (!records || !subdirs || !names) {
+        free(records);
+        free(subdirs);
+        free(names);
+        fprintf(stderr, "Memory allocation failed for the cache.\n");
+        return false;
+    }
+    size_t r = 0;
+    size_t sd = 0;
+    size_t nl = 0;
+    for (int i = 0; i < pool->count; i++) {
+        CacheBuilder *b = &pool->workers[i].cache;
+        for (size_t j = 0; j < b->count; j++) {
+            records[r] = b->records[j];
+            records[r++].subdir_first += sd;
+        }
+        for (size_t j = 0; j < b->subdir_count; j++) {
+            subdirs[sd] = b->subdirs[j];
+            subdirs[sd++].name_offset += nl;
+        }
+        memcpy(names + nl, b->names, b->names_len);
+        nl += b->names_len;
+    }
+    qsort(records, count, sizeof(*records), cmp_cache_record);
+    // The same directory reached twice, e.g. from overlapping paths
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || cmp_cache_record(&records[unique - 1],
+                                   &records[i]) != 0) {
+            records[unique++] = records[i];
+        }
+    }
+
+    CacheHeader h = {.version = CACHE_VERSION,
+            .record_count = unique,
+            .config_hash = c->config_hash,
+            .subdir_count = subdir_count,
+            .names_len = names_len};
+    memcpy(h.magic, CACHE_MAGIC, 8);
+
+    const struct iovec parts[] = {{&h, sizeof(h)},
+            {records, unique * sizeof(*records)},
+            {subdirs, subdir_count * sizeof(*subdirs)}, {names, names_len}};
+    bool ok = replace_file(c->path, parts, 4);
+    if (!ok) {
+        fprintf(stderr, "Error writing cache '%s': %s\n", c->path,
+                strerror(errno));
+    }
+    free(records);
+    free(subdirs);
+    free(names);
+    return ok;
+}
+
+void cache_free(CacheFile *c)
+{
+    if (c->map) {
+        munmap(c->map, c->map_len);
+    }
+}
+
+void cache_builder_free(CacheBuilder *b)
+{
+    free(b->records);
+    free(b->subdirs);
+    free(b->names);
+}
+
+// --plan: notes the identity of the directory about to be scanned. Its
+// record is only written if a target turns up.
+void plan_begin_dir(Worker *w, const struct stat *st)
+{
+    PlanBuilder *b = &w->plan;
+    b->dev = st ? st->st_dev : 0;
+    b->ino = st ? st->st_ino : 0;
+    b->in_dir = false;
+}
+
+// --plan: records target `name`, whose stat `st` gives the inode to check
+// and the size to report, in the directory being scanned.
+void plan_add(Worker *w, DirNode *node, const char *name,
+        const struct stat *st)
+{
+    PlanBuilder *b = &w->plan;
+    const char *dir = b->in_dir ? NULL : format_path(w, node, NULL);
+    size_t dir_len = dir ? strlen(dir) + 1 : 0;
+    size_t name_len = strlen(name) + 1;
+    if (!cache_reserve((void **)&b->dirs, &b->dir_cap, b->dir_count, 1,
+                sizeof(*b->dirs)) ||
+            !cache_reserve((void **)&b->entries, &b->entry_cap,
+                    b->entry_count, 1, sizeof(*b->entries)) ||
+            !cache_reserve((void **)&b->names, &b->names_cap, b->names_len,
+                    dir_len + name_len, 1)) {
+        b->failed = true;
+        return;
+    }
+    if (dir) {
+        const DirNode *root = node;
+        while (root->parent) {
+            root = root->parent;
+        }
+        b->dirs[b->dir_count++] = (PlanDir){.dev = b->dev,
+                .ino = b->ino,
+                .path_offset = b->names_len,
+                .path_len = dir_len - 1,
+                .root_len = strlen(root->name),
+                .entry_first = b->entry_count};
+        memcpy(b->names + b->names_len, dir, dir_len);
+        b->names_len += dir_len;
+        b->in_dir = true;
+    }
+    b->dirs[b->dir_count - 1].entry_count++;
+    b->entries[b->entry_count++] = (PlanEntry){.ino = st->st_ino,
+            .size = st->st_size,
+            .name_offset = b->names_len,
+            .name_len = name_len - 1};
+    memcpy(b->names + b->names_len, name, name_len);
+    b->names_len += name_len;
+}
+
+void plan_builder_free(PlanBuilder *b)
+{
+    free(b->dirs);
+    free(b->entries);
+    free(b->names);
+}
+
+typedef struct {
+    const char *path;
+    const PlanDir *dir;
+    const PlanBuilder *b;
+} PlanDirRef;
+
+int cmp_plan_dir_ref(const void *a, const void *b)
+{
+    return strcmp(((const PlanDirRef *)a)->path,
+            ((const PlanDirRef *)b)->path);
+}
+
+// Merges the workers' records, sorted by path so that plans of the same
+// tree compare equal, and writes the --plan file.
+bool plan_save(Pool *pool, const char *path)
+{
+    size_t dir_count = 0;
+    size_t entry_count = 0;
+    size_t names_len = 0;
+    for (int i = 0; i < pool->count; i++) {
+        PlanBuilder *b = &pool->workers[i].plan;
+        if (b->failed) {
+            fprintf(stderr, "Memory allocation failed for the plan.\n");
+            return false;
+        }
+        dir_count += b->dir_count;
+        entry_count += b->entry_count;
+        names_len += b->names_len;
+    }
+    if (dir_count > UINT32_MAX || entry_count > UINT32_MAX ||
+            names_len > UINT32_MAX) {
+        fprintf(stderr, "Too many targets for the plan.\n");
+        return false;
+    }
+
+    PlanDirRef *refs = malloc((dir_count ? dir_count : 1) * sizeof(*refs));
+    PlanDir *dirs = malloc((dir_count ? dir_count : 1) * sizeof(*dirs));
+    PlanEntry *entries =
+            malloc((entry_count ? entry_count : 1) * sizeof(*entries));
+    char *names = malloc(names_len ? names_len : 1);
+    if (!refs || !dirs || !entries || !names) {
+        free(refs);
+        free(dirs);
+        free(entries);
+        free(names);
+        fprintf(stderr, "Memory allocation failed for the plan.\n");
+        return false;
+    }
+    size_t r = 0;
+    for (int i = 0; i < pool->count; i++) {
+        const PlanBuilder *b = &pool->workers[i].plan;
+        for (size_t j = 0; j < b->dir_count; j++) {
+            refs[r++] = (PlanDirRef){b->names + b->dirs[j].path_offset,
+                    &b->dirs[j], b};
+        }
+    }
+    qsort(refs, dir_count, sizeof(*refs), cmp_plan_dir_ref);
+
+    // Copy each directory's path and targets in the new order
+    size_t e = 0;
+    size_t nl = 0;
+    for (size_t i = 0; i < dir_count; i++) {
+        const PlanDir *d = refs[i].dir;
+        const PlanBuilder *b = refs[i].b;
+        dirs[i] = *d;
+        dirs[i].path_offset = nl;
+        dirs[i].entry_first = e;
+        memcpy(names + nl, refs[i].path, d->path_len + 1);
+        nl += d->path_len + 1;
+        for (uint32_t j = 0; j < d->entry_count; j++) {
+            const PlanEntry *pe = &b->entries[d->entry_first + j];
+            entries[e] = *pe;
+            entries[e++].name_offset = nl;
+            memcpy(names + nl, b->names + pe->name_offset, pe->name_len + 1);
+            nl += pe->name_len + 1;
+        }
+    }
+
+    PlanHeader h = {.version = PLAN_VERSION,
+            .dir_count = dir_count,
+            .entry_count = entry_count,
+            .names_len = names_len};
+    memcpy(h.magic, PLAN_MAGIC, 8);
+    const struct iovec parts[] = {{&h, sizeof(h)},
+            {dirs, dir_count * sizeof(*dirs)},
+            {entries, entry_count * sizeof(*entries)}, {names, names_len}};
+    bool ok = replace_file(path, parts, 4);
+    if (!ok) {
+        fprintf(stderr, "Error writing plan '%s': %s\n", path,
+                strerror(errno));
+    }
+    free(refs);
+    free(dirs);
+    free(entries);
+    free(names);
+    return ok;
+}
+
+// --index-build: records an entry of the directory being scanned.
+void index_add(Worker *w, DirNode *node, const char *name, unsigned char type,
+        bool match, const struct stat *st, ino_t ino)
+{
+    IndexBuilder *b = &w->index;
+    const char *path = format_path(w, node, name);
+    size_t len = strlen(path) + 1;
+    if (!cache_reserve((void **)&b->records, &b->cap, b->count, 1,
+                sizeof(*b->records)) ||
+            !cache_reserve((void **)&b->text, &b->text_cap, b->text_len, len,
+                    1)) {
+        b->failed = true;
+        return;
+    }
+    b->records[b->count++] = (IndexRecord){.path = b->text_len,
+            .size = st && !S_ISDIR(st->st_mode) ? (uint64_t)st->st_size : 0,
+            .ino = st ? st->st_ino : ino,
+            .dev = st ? st->st_dev : 0,
+            .type = type,
+            .flags = (match ? INDEX_MATCH : 0) |
+                    (node->parent ? 0 : INDEX_TOP)};
+    memcpy(b->text + b->text_len, path, len);
+    b->text_len += len;
+}
+
+void index_builder_free(IndexBuilder *b)
+{
+    free(b->records);
+    free(b->text);
+}
+
+// Orders paths with '/' below every other byte, so that everything under
+// a directory sorts right after it and before its next sibling.
+int path_order(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    for (size_t i = 0; i < n; i++) {
+        unsigned x = a[i] == '/' ? 0 : (unsigned char)a[i] + 1u;
+        unsigned y = b[i] == '/' ? 0 : (unsigned char)b[i] + 1u;
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+typedef struct {
+    const char *path;
+    size_t len;
+    const IndexRecord *r;
+} IndexRef;
+
+int cmp_index_ref(const void *a, const void *b)
+{
+    const IndexRef *x = a;
+    const IndexRef *y = b;
+    return path_order(x->path, x->len, y->path, y->len);
+}
+
+size_t put_varint(unsigned char *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Reads a varint from [*p, end), failing on a truncated or overlong one.
+bool get_varint(const unsigned char **p, const unsigned char *end,
+        uint64_t *v)
+{
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char byte = *(*p)++;
+        x |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Merges the workers' entries, sorts them and writes the --index-build
+// file.
+bool index_save(Pool *pool, const char *path)
+{
+    size_t count = 0;
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->workers[i].index.failed) {
+            fprintf(stderr, "Memory allocation failed for the index.\n");
+            return false;
+        }
+        count += pool->workers[i].index.count;
+    }
+    size_t restart_count = (count + INDEX_RESTART - 1) / INDEX_RESTART;
+    IndexRef *refs = malloc((count ? count : 1) * sizeof(*refs));
+    uint64_t *restarts =
+            malloc((restart_count ? restart_count : 1) * sizeof(*restarts));
+    if (!refs || !restarts) {
+        free(refs);
+        free(restarts);
+        fprintf(stderr, "Memory allocation failed for the index.\n");
+        return false;
+    }
+    size_t n = 0;
+    unsigned long targets = 0;
+    for (int i = 0; i < pool->count; i++) {
+        const IndexBuilder *b = &pool->workers[i].index;
+        for (size_t j = 0; j < b->count; j++) {
+            const char *p = b->text + b->records[j].path;
+            refs[n++] = (IndexRef){p, strlen(p), &b->records[j]};
+            targets += b->records[j].flags & INDEX_MATCH;
+        }
+    }
+    qsort(refs, count, sizeof(*refs), cmp_index_ref);
+
+    unsigned char *data = NULL;
+    size_t data_len = 0;
+    size_t data_cap = 0;
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        size_t shared = 0;
+        if (i % INDEX_RESTART == 0) {
+            restarts[i / INDEX_RESTART] = data_len;
+        } else {
+            const IndexRef *prev = &refs[i - 1];
+            while (shared < prev->len && shared < refs[i].len &&
+                    prev->path[shared] == refs[i].path[shared]) {
+                shared++;
+            }
+        }
+        size_t suffix = refs[i].len - shared;
+        if (data_len + suffix + 52 > data_cap) {
+            size_t cap = data_cap ? data_cap * 2 : 64 * 1024;
+            while (cap < data_len + suffix + 52) {
+                cap *= 2;
+            }
+            unsigned char *grown = realloc(data, cap);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            data = grown;
+            data_cap = cap;
+        }
+        const IndexRecord *r = refs[i].r;
+        data_len += put_varint(data + data_len, shared);
+        data_len += put_varint(data + data_len, suffix);
+        memcpy(data + data_len, refs[i].path + shared, suffix);
+        data_len += suffix;
+        data[data_len++] = r->type;
+        data[data_len++] = r->flags;
+        data_len += put_varint(data + data_len, r->size);
+        data_len += put_varint(data + data_len, r->ino);
+        data_len += put_varint(data + data_len, r->dev);
+    }
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed for the index.\n");
+    } else {
+        IndexHeader h = {.version = INDEX_VERSION,
+                .entry_count = count,
+                .restart_count = restart_count,
+                .data_len = data_len,
+                .config_hash = cache_config_hash(pool->opts)};
+        memcpy(h.magic, INDEX_MAGIC, 8);
+        const struct iovec parts[] = {{&h, sizeof(h)},
+                {restarts, restart_count * sizeof(*restarts)},
+                {data, data_len}};
+        ok = replace_file(path, parts, 3);
+        if (!ok) {
+            fprintf(stderr, "Error writing index '%s': %s\n", path,
+                    strerror(errno));
+        } else if (!pool->opts->quiet) {
+            out_printf(&pool->workers[0],
+                    "Indexed %zu entries, %lu targets, in %s (%zu bytes)\n",
+                    count, targets, path, sizeof(h) +
+                            restart_count * sizeof(*restarts) + data_len);
+        }
+    }
+    free(refs);
+    free(restarts);
+    free(data);
+    return ok;
+}
+
+// Metadata I/O engines. The sync engine issues fstatat() and unlinkat()
+// as each entry is reached. The io_uring engine turns the same calls into
+// statx and unlinkat requests, submits them in batches of up to
+// --queue-depth per directory and handles the completions as they are
+// reaped; whenever no ring can be set up the sync engine is used instead.
+void handle_entry(Worker *w, DirNode *node, const char *name,
+        unsigned char type, ino_t ino, const struct stat *st);
+void stat_now(Worker *w, DirNode *node, const char *name, unsigned char type);
+void unlink_now(Worker *w, DirNode *node, const char *name, uint64_t bytes);
+
+void report_stat_error(Worker *w, DirNode *node, const char *name, int err)
+{
+    count_error(w, err);
+    node->dirty = true;
+    if (!w->pool->opts->quiet) {
+        emit(w, EV_STAT_ERROR, format_path(w, node, name), err);
+    }
+}
+
+// Credits the space of one deleted file, if its size is known.
+void count_reclaimed(Worker *w, uint64_t bytes)
+{
+    if (bytes != SIZE_UNKNOWN) {
+        w->counters.bytes_reclaimed += bytes;
+        w->counters.sized++;
+    }
+}
+
+void report_unlink(Worker *w, DirNode *node, const char *name,
+        uint64_t bytes, int err)
+{
+    if (err == 0) {
+        w->counters.deleted++;
+        count_reclaimed(w, bytes);
+        if (!w->pool->opts->quiet) {
+            emit(w, EV_DELETED, format_path(w, node, name), 0);
+        }
+    } else if (err == ENOENT && w->pool->opts->watch) {
+        // Already gone: created and removed again between event and batch,
+        // or deleted by the scan that also produced the event
+        return;
+    } else {
+        w->counters.delete_failed++;
+        count_error(w, err);
+        emit(w, EV_UNLINK_ERROR, format_path(w, node, name), err);
+    }
+}
+
+#ifdef __linux__
+typedef struct {
+    DirNode *node;
+    bool unlink;
+    bool busy; // queued or in flight
+    unsigned char type;
+    uint64_t bytes;
+    struct statx stx;
+    char name[NAME_MAX + 1];
+} IoSlot;
+
+struct IoRing {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned queued;    // prepared but not yet submitted
+    unsigned in_flight; // submitted but not yet reaped
+    unsigned depth;
+    IoSlot *slots;
+    unsigned *free_slots;
+    unsigned free_count;
+    bool broken; // io_uring_enter failed; only sync I/O from then on
+};
+
+void io_ring_free(IoRing *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    free(ring->slots);
+    free(ring->free_slots);
+    free(ring);
+}
+
+// Sets up a ring of `depth` entries, or returns NULL (with errno set) if
+// the kernel cannot run statx and unlinkat requests.
+IoRing *io_ring_new(unsigned depth)
+{
+    IoRing *ring = counted_calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    struct io_uring_params p = {0};
+    ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } probe = {0};
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                &probe, 256) == -1 ||
+            probe.probe.last_op < IORING_OP_UNLINKAT ||
+            !(probe.ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) ||
+            !(probe.ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED)) {
+        io_ring_free(ring);
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) {
+            ring->sq_map_len = ring->cq_map_len;
+        }
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        io_ring_free(ring);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            io_ring_free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        io_ring_free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    ring->depth = p.sq_entries < depth ? p.sq_entries : depth;
+    ring->slots = counted_malloc(ring->depth * sizeof(*ring->slots));
+    ring->free_slots =
+            counted_malloc(ring->depth * sizeof(*ring->free_slots));
+    if (!ring->slots || !ring->free_slots) {
+        io_ring_free(ring);
+        return NULL;
+    }
+    for (unsigned i = 0; i < ring->depth; i++) {
+        ring->free_slots[i] = ring->depth - 1 - i;
+    }
+    ring->free_count = ring->depth;
+    return ring;
+}
+
+// Returns the worker's ring, setting it up on first use. Once a ring
+// cannot be created, every worker stays on the sync engine.
+IoRing *io_ring_get(Worker *w)
+{
+    Pool *pool = w->pool;
+    if (w->ring || pool->opts->io != IO_URING ||
+            atomic_load_explicit(&pool->uring_failed, memory_order_relaxed)) {
+        return w->ring && !w->ring->broken ? w->ring : NULL;
+    }
+    w->ring = io_ring_new(pool->opts->queue_depth);
+    if (!w->ring && !atomic_exchange(&pool->uring_failed, true) &&
+            pool->opts->verbose && !pool->opts->quiet) {
+        out_printf(w, "io_uring unavailable (%s), using synchronous I/O\n",
+                strerror(errno));
+    }
+    return w->ring;
+}
+
+// Handles every completion that has arrived, counting them by kind.
+void io_ring_reap(Worker *w, unsigned *stats, unsigned *unlinks)
+{
+    IoRing *ring = w->ring;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        IoSlot *slot = &ring->slots[cqe->user_data];
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        ring->in_flight--;
+
+        // Release the slot before handling it, so the handler can queue
+        // a follow-up request (the unlink after a stat) without waiting.
+        DirNode *node = slot->node;
+        unsigned char type = slot->type;
+        char name[NAME_MAX + 1];
+        memcpy(name, slot->name, sizeof(name));
+        struct stat st;
+        if (!slot->unlink && res == 0) {
+            st.st_mode = slot->stx.stx_mode;
+            st.st_dev = makedev(slot->stx.stx_dev_major,
+                    slot->stx.stx_dev_minor);
+            st.st_ino = slot->stx.stx_ino;
+            st.st_size = slot->stx.stx_size;
+            st.st_nlink = slot->stx.stx_nlink;
+            st.st_blocks = slot->stx.stx_blocks;
+        }
+        bool unlink = slot->unlink;
+        uint64_t bytes = slot->bytes;
+        slot->busy = false;
+        ring->free_slots[ring->free_count++] = (unsigned)(slot - ring->slots);
+
+        if (unlink) {
+            (*unlinks)++;
+            report_unlink(w, node, name, bytes, res < 0 ? -res : 0);
+        } else if (res < 0) {
+            (*stats)++;
+            report_stat_error(w, node, name, -res);
+        } else {
+            (*stats)++;
+            handle_entry(w, node, name, type, 0, &st);
+        }
+    }
+}
+
+// After io_uring_enter failed for a reason other than a retryable one:
+// marks the ring broken, so the worker carries on with the sync engine,
+// and finishes its requests. Those still waiting for submission are
+// carried out synchronously. Those the kernel already has are given
+// IO_RING_ABANDON_MS to complete. After that, an unlink whose name is
+// gone counts as deleted and any other request is reported as failed
+// with EIO; their slots stay with the ring until it is freed.
+#define IO_RING_ABANDON_MS 1000
+
+void io_ring_abandon(Worker *w, int err)
+{
+    IoRing *ring = w->ring;
+    fprintf(stderr, "io_uring_enter failed: %s; using synchronous I/O\n",
+            strerror(err));
+    ring->broken = true;
+    atomic_store(&w->pool->uring_failed, true);
+
+    // The unsubmitted requests are the last `queued` ones in the queue
+    unsigned tail = *ring->sq_tail;
+    for (unsigned i = 0; i < ring->queued; i++) {
+        unsigned pos = (tail - ring->queued + i) & ring->sq_mask;
+        IoSlot *slot = &ring->slots[ring->sqes[ring->sq_array[pos]].user_data];
+        slot->busy = false;
+        ring->free_slots[ring->free_count++] = (unsigned)(slot - ring->slots);
+        if (slot->unlink) {
+            unlink_now(w, slot->node, slot->name, slot->bytes);
+        } else {
+            stat_now(w, slot->node, slot->name, slot->type);
+        }
+    }
+    ring->queued = 0;
+
+    unsigned stats = 0;
+    unsigned unlinks = 0;
+    for (int ms = 0; ring->in_flight > 0 && ms < IO_RING_ABANDON_MS; ms++) {
+        io_ring_reap(w, &stats, &unlinks);
+        if (ring->in_flight > 0) {
+            nanosleep(&(struct timespec){0, 1000000}, NULL);
+        }
+    }
+    for (unsigned i = 0; ring->in_flight > 0 && i < ring->depth; i++) {
+        IoSlot *slot = &ring->slots[i];
+        if (slot->busy) {
+            ring->in_flight--;
+            if (slot->unlink) {
+                struct stat st;
+                bool gone = fstatat(slot->node->fd, slot->name, &st,
+                                    AT_SYMLINK_NOFOLLOW) == -1 &&
+                        errno == ENOENT;
+                report_unlink(w, slot->node, slot->name,
+                        gone ? slot->bytes : 0, gone ? 0 : EIO);
+            } else {
+                report_stat_error(w, slot->node, slot->name, EIO);
+            }
+        }
+    }
+    ring->in_flight = 0;
+}
+
+// Submits everything prepared so far, waits for at least `wait` requests
+// to complete and handles every completion that has arrived.
+void io_ring_run(Worker *w, unsigned wait)
+{
+    IoRing *ring = w->ring;
+    if (wait > ring->queued + ring->in_flight) {
+        wait = ring->queued + ring->in_flight;
+    }
+    uint64_t start = phase_start(w);
+    long done = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    uint64_t elapsed = start ? clock_ns(CLOCK_MONOTONIC) - start : 0;
+    unsigned stats = 0;
+    unsigned unlinks = 0;
+    if (done > 0) {
+        ring->queued -= (unsigned)done;
+        ring->in_flight += (unsigned)done;
+    } else if (done == -1 && errno != EINTR && errno != EAGAIN &&
+               errno != EBUSY) {
+        io_ring_abandon(w, errno);
+        return;
+    }
+
+    io_ring_reap(w, &stats, &unlinks);
+    if (stats + unlinks > 0) {
+        w->span_ns[PHASE_STAT] += elapsed * stats / (stats + unlinks);
+        w->span_ns[PHASE_UNLINK] += elapsed * unlinks / (stats + unlinks);
+    }
+}
+
+// Prepares a request for `name` in `node`. Requests go to the kernel as a
+// batch once every slot is taken (or the directory is done), and waiting
+// for a free slot reaps whatever has completed in the meantime.
+void io_ring_queue(Worker *w, DirNode *node, const char *name,
+        unsigned char type, bool unlink, uint64_t bytes)
+{
+    IoRing *ring = w->ring;
+    while (ring->free_count == 0) {
+        io_ring_run(w, 1);
+        if (ring->broken) {
+            if (unlink) {
+                unlink_now(w, node, name, bytes);
+            } else {
+                stat_now(w, node, name, type);
+            }
+            return;
+        }
+    }
+    unsigned index = ring->free_slots[--ring->free_count];
+    IoSlot *slot = &ring->slots[index];
+    slot->node = node;
+    slot->busy = true;
+    slot->unlink = unlink;
+    slot->type = type;
+    slot->bytes = bytes;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+
+    unsigned tail = *ring->sq_tail;
+    unsigned pos = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[pos];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = node->fd;
+    sqe->addr = (uintptr_t)slot->name;
+    sqe->user_data = index;
+    if (unlink) {
+        sqe->opcode = IORING_OP_UNLINKAT;
+    } else {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->len = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_NLINK |
+                STATX_BLOCKS;
+        sqe->off = (uintptr_t)&slot->stx;
+    }
+    ring->sq_array[pos] = pos;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+// Completes every request queued for the directory being scanned.
+void io_drain(Worker *w)
+{
+    while (w->ring && !w->ring->broken &&
+            (w->ring->queued || w->ring->in_flight)) {
+        io_ring_run(w, 1);
+    }
+}
+#else
+void io_drain(Worker *w)
+{
+    (void)w;
+}
+#endif
+
+// Stats `name` and carries on with handle_entry() once the result is in.
+void io_stat(Worker *w, DirNode *node, const char *name, unsigned char type)
+{
+    throttle(w, &ops_limit);
+    w->counters.stats_issued++;
+#ifdef __linux__
+    if (io_ring_get(w)) {
+        io_ring_queue(w, node, name, type, false, 0);
+        return;
+    }
+#endif
+    stat_now(w, node, name, type);
+}
+
+// The sync engine's stat, and what io_stat() falls back to.
+void stat_now(Worker *w, DirNode *node, const char *name, unsigned char type)
+{
+    struct stat st;
+    uint64_t start = phase_start(w);
+    int ret = fstatat(node->fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    int err = errno;
+    phase_end(w, PHASE_STAT, start);
+    if (ret == -1) {
+        report_stat_error(w, node, name, err);
+        return;
+    }
+    handle_entry(w, node, name, type, 0, &st);
+}
+
+// Deletes `name`, crediting `bytes` to the space reclaimed on success.
+void io_unlink(Worker *w, DirNode *node, const char *name, uint64_t bytes)
+{
+    throttle(w, &ops_limit);
+#ifdef __linux__
+    if (io_ring_get(w)) {
+        io_ring_queue(w, node, name, DT_UNKNOWN, true, bytes);
+        return;
+    }
+#endif
+    unlink_now(w, node, name, bytes);
+}
+
+// The sync engine's unlink, and what io_unlink() falls back to.
+void unlink_now(Worker *w, DirNode *node, const char *name, uint64_t bytes)
+{
+    uint64_t start = phase_start(w);
+    int err = unlinkat(node->fd, name, 0) == 0 ? 0 : errno;
+    phase_end(w, PHASE_UNLINK, start);
+    report_unlink(w, node, name, bytes, err);
+}
+
+// -i: puts a target on the worker's list for the review after the scan.
+// The directory's path is stored once for its run of targets.
+void review_add(Worker *w, DirNode *node, const char *name, uint64_t bytes)
+{
+    CandidateList *list = &w->review;
+    const char *dir = format_path(w, node, NULL);
+    size_t dir_len = strlen(dir) + 1;
+    size_t name_len = strlen(name) + 1;
+    bool same_dir = list->count > 0 &&
+            strcmp(list->text + list->items[list->count - 1].dir, dir) == 0;
+    size_t text_extra = name_len + (same_dir ? 0 : dir_len);
+
+    struct stat st;
+    if (!cache_reserve((void **)&list->items, &list->cap, list->count, 1,
+                sizeof(*list->items)) ||
+            !cache_reserve((void **)&list->text, &list->text_cap,
+                    list->text_len, text_extra, 1) ||
+            (!same_dir && fstat(node->fd, &st) == -1)) {
+        fprintf(stderr, "Error listing '%s' for review: %s\n",
+                format_path(w, node, name), strerror(errno));
+        return;
+    }
+    Candidate *c = &list->items[list->count++];
+    if (same_dir) {
+        *c = list->items[list->count - 2];
+    } else {
+        c->dir = list->text_len;
+        c->dev = st.st_dev;
+        c->ino = st.st_ino;
+        memcpy(list->text + list->text_len, dir, dir_len);
+        list->text_len += dir_len;
+    }
+    c->name = list->text_len;
+    c->bytes = bytes;
+    c->node = node;
+    atomic_fetch_add(&node->refs, 1);
+    memcpy(list->text + list->text_len, name, name_len);
+    list->text_len += name_len;
+}
+
+// Decides what to do with one directory entry. `st` is NULL until the
+// entry has been stated; entries whose d_type says enough never are.
+void handle_entry(Worker *w, DirNode *node, const char *name,
+        unsigned char type, ino_t ino, const struct stat *st)
+{
+    const Options *opts = w->pool->opts;
+    mode_t mode;
+
+    // Trust d_type where the filesystem provides it and only stat for
+    // DT_UNKNOWN, or later on when -x needs the st_dev of a directory.
+    if (st) {
+        mode = st->st_mode;
+    } else if (type == DT_UNKNOWN) {
+        io_stat(w, node, name, type);
+        return;
+    } else if (opts->index_build &&
+            (type != DT_DIR || opts->one_file_system)) {
+        // The index records the size of every file, and takes each entry
+        // once: a directory -x would stat further down is stated here
+        w->counters.stats_avoided--;
+        io_stat(w, node, name, type);
+        return;
+    } else {
+        mode = type == DT_DIR ? S_IFDIR : type == DT_LNK ? S_IFLNK : S_IFREG;
+    }
+    if (opts->index_build) {
+        index_add(w, node, name, st ? IFTODT(st->st_mode) : type,
+                !S_ISDIR(mode) && is_target(name, opts), st, ino);
+    }
+
+    // -L: a symlink to a directory is entered like one. The directory
+    // holding it is never taken from the cache, which only knows real
+    // subdirectories.
+    struct stat target;
+    bool via_link = false;
+    if (S_ISLNK(mode) && opts->follow) {
+        throttle(w, &ops_limit);
+        w->counters.stats_issued++;
+        uint64_t start = phase_start(w);
+        int ret = fstatat(node->fd, name, &target, 0);
+        phase_end(w, PHASE_STAT, start);
+        if (ret == 0 && S_ISDIR(target.st_mode)) {
+            node->dirty = true;
+            via_link = true;
+            st = &target;
+            mode = target.st_mode;
+        }
+    }
+
+    if (S_ISDIR(mode)) {
+        // Every subdirectory goes on the record, once, even when this run
+        // does not enter it
+        if (opts->cache.path && !via_link && (!st || type == DT_UNKNOWN)) {
+            cache_add_subdir(w, name, st ? st->st_ino : ino);
+        }
+
+        if (opts->max_depth != -1 && node->depth >= opts->max_depth) {
+            return;
+        }
+
+        // Check exclusion
+        if (is_excluded(name, opts)) {
+            if (opts->verbose && !opts->quiet) {
+                emit(w, EV_EXCLUDED, format_path(w, node, name), 0);
+            }
+            return;
+        }
+
+        // Check filesystem boundary
+        if (opts->one_file_system) {
+            if (!st) {
+                // d_type alone was not enough after all
+                w->counters.stats_avoided--;
+                io_stat(w, node, name, type);
+                return;
+            }
+            if (st->st_dev != node->root_dev) {
+                if (opts->verbose && !opts->quiet) {
+                    emit(w, EV_OTHER_FS, format_path(w, node, name), 0);
+                }
+                return;
+            }
+        }
+
+        // Queue the subdirectory; any worker may pick it up
+        DirNode *child = node_new(w, node, name);
+        if (child) {
+            child->ino = st ? st->st_ino : ino;
+            child->follow = via_link;
+        }
+        if (!child || !pool_push(w, child)) {
+            fprintf(stderr, "Memory allocation failed for '%s'.\n",
+                    format_path(w, node, name));
+            if (child) {
+                node_release_fd(node);
+                node_release(child);
+            }
+        }
+    } else if (is_target(name, opts)) {
+        node->dirty = true;
+        // --plan records the inode and size, which takes a stat. --stats
+        // only counts the space of files that were stated anyway, so it
+        // does not change the run it measures.
+        if (!st && opts->plan) {
+            w->counters.stats_avoided--;
+            io_stat(w, node, name, type);
+            return;
+        }
+        w->counters.matched++;
+        // Other links keep the data alive
+        uint64_t bytes = !st ? SIZE_UNKNOWN
+                : st->st_nlink == 1 ? (uint64_t)st->st_blocks * 512 : 0;
+
+        if (opts->interactive) {
+            // Asked about once the scan is done
+            review_add(w, node, name, bytes);
+        } else if (opts->dry_run) {
+            w->counters.would_delete++;
+            count_reclaimed(w, bytes);
+            if (opts->plan) {
+                plan_add(w, node, name, st);
+            }
+            if (!opts->quiet) {
+                emit(w, EV_WOULD_DELETE, format_path(w, node, name), 0);
+            }
+        } else if (w->pool->deletes) {
+            delete_queue_push(w->pool->deletes, node, name, bytes);
+        } else {
+            io_unlink(w, node, name, bytes);
+        }
+    }
+}
+
+// Opens `node`'s directory relative to its parent, reopening the parent
+// first if it was parked, and drops the reference on the parent's
+// descriptor. Sets `skipped` when --cache knows the directory is denied.
+int node_open(Worker *w, DirNode *node, bool *skipped)
+{
+    const Options *opts = w->pool->opts;
+    DirNode *parent = node->parent;
+    *skipped = false;
+    if (!parent) {
+        int fd = open_dir_at(AT_FDCWD, node->name, true);
+        if (fd != -1 && fd_budget) {
+            atomic_fetch_add(&open_dirs, 1);
+        }
+        return fd;
+    }
+
+    int fd = -1;
+    int err = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fd_budget) {
+            pthread_rwlock_rdlock(&park_lock);
+            if (parent->fd == -1) {
+                // Parked: reopen it, unless another worker just did
+                pthread_rwlock_unlock(&park_lock);
+                pthread_rwlock_wrlock(&park_lock);
+                if (parent->fd == -1 && !node_reopen(w, parent)) {
+                    err = errno;
+                    pthread_rwlock_unlock(&park_lock);
+                    break;
+                }
+            }
+        }
+        *skipped = opts->cache.path && cache_skip_denied(w, node);
+        if (!*skipped) {
+            fd = open_dir_at(parent->fd, node->name, node->follow);
+            err = errno;
+            if (fd == -1 && opts->cache.path &&
+                    (err == EACCES || err == EPERM)) {
+                cache_note_denied(w, node);
+            }
+        }
+        if (fd_budget) {
+            pthread_rwlock_unlock(&park_lock);
+        }
+        // Out of descriptors despite the budget (other users, a lower
+        // system-wide limit): park whatever can be and try once more
+        if (fd != -1 || !fd_budget || (err != EMFILE && err != ENFILE)) {
+            break;
+        }
+        park_ancestors(w, parent->parent, true);
+    }
+    node_release_fd(parent);
+    if (fd != -1 && fd_budget) {
+        atomic_fetch_add(&open_dirs, 1);
+    }
+    errno = err;
+    return fd;
+}
+
+// --progress: notes the directory a worker starts on, and hands it to
+// the reporter if asked to. The path is formatted by the reporter.
+void progress_begin(Worker *w, DirNode *node)
+{
+    Progress *p = &w->progress;
+    atomic_store_explicit(&p->depth, node->depth, memory_order_relaxed);
+    if (atomic_load_explicit(&p->want_path, memory_order_relaxed)) {
+        atomic_store_explicit(&p->want_path, false, memory_order_relaxed);
+        atomic_fetch_add(&node->refs, 1);
+        // One the reporter never took
+        node_release(atomic_exchange_explicit(&p->node, node,
+                memory_order_release));
+    }
+}
+
+// --progress: makes the worker's counters visible to the reporter.
+void progress_publish(Worker *w)
+{
+    Progress *p = &w->progress;
+    const Counters *c = &w->counters;
+    atomic_store_explicit(&p->dirs, c->dirs_opened, memory_order_relaxed);
+    atomic_store_explicit(&p->entries, c->entries, memory_order_relaxed);
+    atomic_store_explicit(&p->matched, c->matched, memory_order_relaxed);
+    atomic_store_explicit(&p->deleted, c->deleted + c->would_delete,
+            memory_order_relaxed);
+    atomic_store_explicit(&p->errors, c->error_count, memory_order_relaxed);
+}
+
+int cmp_sorted_entry(const void *a, const void *b)
+{
+    const SortedEntry *x = a;
+    const SortedEntry *y = b;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// --sort-inode: reads the whole directory first, keeping only entries
+// that can lead to work, and handles them by inode number. On ext4 and
+// XFS inode numbers follow the on-disk inode table while readdir order
+// is a hash, so stats and unlinks in this order read the table mostly
+// sequentially. Files go first, ascending; subdirectories are then pushed
+// descending, so the worker's LIFO deque hands them out ascending.
+// Returns the read error, if any.
+int scan_sorted(Worker *w, DirNode *node, DirReader *reader)
+{
+    const Options *opts = w->pool->opts;
+    size_t count = 0;
+    size_t names_len = 0;
+    DirEntry entry;
+    while (dir_reader_next(reader, &entry)) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        w->counters.entries++;
+        if (entry.type != DT_UNKNOWN) {
+            w->counters.stats_avoided++;
+        }
+        if (entry.type != DT_DIR && entry.type != DT_UNKNOWN &&
+                !(entry.type == DT_LNK && opts->follow) &&
+                !opts->index_build && !is_target(entry.name, opts)) {
+            continue;
+        }
+        size_t len = strlen(entry.name) + 1;
+        if (!cache_reserve((void **)&w->sorted, &w->sorted_cap, count, 1,
+                    sizeof(*w->sorted)) ||
+                !cache_reserve((void **)&w->sorted_names,
+                        &w->sorted_names_cap, names_len, len, 1)) {
+            // Out of memory: this one goes unsorted
+            handle_entry(w, node, entry.name, entry.type, entry.ino, NULL);
+            continue;
+        }
+        memcpy(w->sorted_names + names_len, entry.name, len);
+        w->sorted[count++] = (SortedEntry){entry.ino, names_len, entry.type};
+        names_len += len;
+    }
+    int read_errno = errno;
+
+    qsort(w->sorted, count, sizeof(*w->sorted), cmp_sorted_entry);
+    for (size_t i = 0; i < count; i++) {
+        const SortedEntry *e = &w->sorted[i];
+        if (e->type != DT_DIR) {
+            handle_entry(w, node, w->sorted_names + e->name, e->type, e->ino,
+                    NULL);
+        }
+    }
+    for (size_t i = count; i-- > 0;) {
+        const SortedEntry *e = &w->sorted[i];
+        if (e->type == DT_DIR) {
+            handle_entry(w, node, w->sorted_names + e->name, e->type, e->ino,
+                    NULL);
+        }
+    }
+    return read_errno;
+}
+
+#ifdef __linux__
+void watch_scanned_dir(Watcher *wt, DirNode *node, int fd);
+#endif
+
+// Deletes target files in one directory and queues its subdirectories.
+void scan_dir(Worker *w, DirNode *node)
+{
+    const Options *opts = w->pool->opts;
+    DirNode *parent = node->parent;
+
+    // Check depth limit
+    if (opts->max_depth != -1 && node->depth > opts->max_depth) {
+        if (parent) {
+            node_release_fd(parent);
+        }
+        return;
+    }
+
+    // Opening and reading the directory counts as one operation
+    throttle(w, &dirs_limit);
+    throttle(w, &ops_limit);
+    span_begin(w);
+    bool skipped;
+    int fd = node_open(w, node, &skipped);
+    int saved = errno;
+    if (skipped) {
+        span_end(w, PHASE_READDIR);
+        return;
+    }
+
+    struct stat dir_st;
+    bool have_st = false;
+    const CacheRecord *cached = NULL;
+    if (fd != -1 && (opts->cache.path || w->pool->visited || opts->plan)) {
+        have_st = fstat(fd, &dir_st) == 0;
+        if (have_st) {
+            node->dev = dir_st.st_dev;
+        }
+    }
+    // Scanned already from another starting path or another link
+    if (have_st && w->pool->visited &&
+            !visited_insert(w->pool->visited, dir_st.st_dev, dir_st.st_ino)) {
+        close(fd);
+        if (fd_budget) {
+            atomic_fetch_sub(&open_dirs, 1);
+        }
+        span_end(w, PHASE_READDIR);
+        if (opts->verbose && !opts->quiet) {
+            emit(w, EV_VISITED, format_path(w, node, NULL), 0);
+        }
+        return;
+    }
+    if (have_st && opts->cache.path) {
+        cached = cache_lookup_clean(&opts->cache, &dir_st);
+    }
+    if (fd != -1 && opts->plan) {
+        plan_begin_dir(w, have_st ? &dir_st : NULL);
+    }
+    DirReader reader = {.dir = NULL};
+    if (fd != -1 && !cached &&
+            !dir_reader_open(&reader, w, fd, opts->reader)) {
+        saved = errno;
+        close(fd);
+        if (fd_budget) {
+            atomic_fetch_sub(&open_dirs, 1);
+        }
+        fd = -1;
+    }
+    if (fd == -1) {
+        count_error(w, saved);
+        span_end(w, PHASE_READDIR);
+        if (!opts->quiet) {
+            // macOS often returns EPERM for protected Library folders (TCC)
+            // EACCES is standard permission denied.
+            if (saved == EACCES || saved == EPERM) {
+                if (opts->verbose) {
+                    emit(w, EV_DENIED, format_path(w, node, NULL), 0);
+                }
+            } else {
+                emit(w, EV_OPEN_ERROR, format_path(w, node, NULL), saved);
+            }
+        }
+        return;
+    }
+    node->fd = fd;
+    node->dir = reader.dir;
+    atomic_store(&node->fd_refs, 1);
+    w->counters.dirs_opened++;
+#ifdef __linux__
+    if (w->pool->watcher) {
+        watch_scanned_dir(w->pool->watcher, node, fd);
+    }
+#endif
+    if (opts->progress) {
+        progress_begin(w, node);
+    }
+    size_t subdir_mark = w->cache.subdir_count;
+    size_t names_mark = w->cache.names_len;
+    int read_errno = 0;
+
+    if (cached) {
+        w->counters.dirs_cached++;
+        const CacheSubdir *sd = &opts->cache.subdirs[cached->subdir_first];
+        for (uint32_t i = 0; i < cached->subdir_count; i++) {
+            handle_entry(w, node, opts->cache.names + sd[i].name_offset,
+                    DT_DIR, sd[i].ino, NULL);
+        }
+    } else {
+        if (opts->verbose && !opts->quiet) {
+            emit(w, EV_SCAN, format_path(w, node, NULL), 0);
+        }
+
+        DirEntry entry;
+        while (!opts->sort_inode && dir_reader_next(&reader, &entry)) {
+            // Skip . and ..
+            if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)
+                continue;
+
+            w->counters.entries++;
+            if (entry.type != DT_UNKNOWN) {
+                w->counters.stats_avoided++;
+            }
+            handle_entry(w, node, entry.name, entry.type, entry.ino, NULL);
+        }
+        read_errno = opts->sort_inode ? scan_sorted(w, node, &reader) : errno;
+    }
+    io_drain(w);
+    if (read_errno != 0) {
+        count_error(w, read_errno);
+        if (!opts->quiet) {
+            emit(w, EV_READ_ERROR, format_path(w, node, NULL), read_errno);
+        }
+    }
+    if (opts->cache.path) {
+        cache_finish_dir(w, node, have_st ? &dir_st : NULL, read_errno == 0,
+                subdir_mark, names_mark);
+    }
+
+    atomic_store(&node->scanned, true);
+    if (fd_budget && atomic_load(&open_dirs) > fd_budget) {
+        park_ancestors(w, node, false);
+    }
+    node_release_fd(node);
+    if (opts->progress) {
+        progress_publish(w);
+    }
+    span_end(w, PHASE_READDIR);
+    // A terminal gets each directory's lines as soon as it is done
+    if (w->pool->out.tty) {
+        out_flush(w, true);
+    }
+}
+
+// Deletion worker: drains the queue in batches of up to --queue-depth,
+// so with --io uring each batch also goes to the kernel in one submit.
+void *deleter_main(void *arg)
+{
+    Worker *w = arg;
+    DeleteQueue *q = w->pool->deletes;
+    int batch_max = w->pool->opts->queue_depth;
+    DirNode *batch[batch_max];
+    char name[NAME_MAX + 1];
+    uint64_t bytes;
+    unsigned round = 0;
+    thread_allocs = 0;
+
+    for (;;) {
+        int count = 0;
+        DirNode *node;
+        while (count < batch_max &&
+                (node = delete_queue_try_pop(q, name, &bytes))) {
+            if (count == 0) {
+                span_begin(w);
+            }
+            batch[count++] = node;
+            io_unlink(w, node, name, bytes);
+        }
+        if (count == 0) {
+            if (atomic_load(&q->closed)) {
+                // Nothing can be pushed after closing; one more look
+                // catches anything that landed just before it.
+                if (!(node = delete_queue_try_pop(q, name, &bytes))) {
+                    break;
+                }
+                span_begin(w);
+                batch[count++] = node;
+                io_unlink(w, node, name, bytes);
+            } else {
+                backoff(&round);
+                continue;
+            }
+        }
+        round = 0;
+        io_drain(w);
+        for (int i = 0; i < count; i++) {
+            node_release_fd(batch[i]);
+            atomic_fetch_sub(&batch[i]->deletes, 1);
+            node_release(batch[i]);
+        }
+        if (w->pool->opts->progress) {
+            progress_publish(w);
+        }
+        span_end(w, PHASE_UNLINK);
+    }
+    w->counters.allocations += thread_allocs;
+    return NULL;
+}
+
+// Runs scans until every queued directory has been handled, taking work
+// from the worker's own deque first and stealing from the others once it
+// runs dry.
+void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    Pool *pool = w->pool;
+    thread_allocs = 0;
+
+    for (;;) {
+        // Parked by -j auto; whatever is left in the deque gets stolen
+        if (w->id >= atomic_load(&pool->active)) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (w->id >= atomic_load(&pool->active) &&
+                    atomic_load(&pool->pending) > 0) {
+                pthread_cond_wait(&pool->park_cond, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+
+        DirNode *node = deque_take(&w->deque, false);
+        // Steal within the worker's own device lane, then anywhere
+        for (int pass = 0; !node && pass < 2; pass++) {
+            for (int i = 1; !node && i < pool->count; i++) {
+                int victim = (w->id + i) % pool->count;
+                if ((victim % pool->lanes == w->id % pool->lanes) == !pass) {
+                    node = deque_take(&pool->workers[victim].deque, true);
+                }
+            }
+        }
+
+        if (node) {
+            atomic_fetch_sub(&pool->queued, 1);
+            uint64_t began = pool->opts->auto_jobs ? clock_ns(CLOCK_MONOTONIC)
+                                                   : 0;
+            unsigned long entries = w->counters.entries;
+            scan_dir(w, node);
+            if (began) {
+                atomic_fetch_add_explicit(&pool->work_done,
+                        1 + w->counters.entries - entries,
+                        memory_order_relaxed);
+                atomic_fetch_add_explicit(&pool->busy_ns,
+                        clock_ns(CLOCK_MONOTONIC) - began,
+                        memory_order_relaxed);
+            }
+            node_release(node);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_cond_broadcast(&pool->park_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        atomic_store_explicit(&w->progress.depth, -1, memory_order_relaxed);
+        pthread_mutex_lock(&pool->idle_lock);
+        if (atomic_load(&pool->pending) == 0) {
+            pthread_mutex_unlock(&pool->idle_lock);
+            break;
+        }
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->queued) == 0 &&
+                atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    w->counters.allocations += thread_allocs;
+    return NULL;
+}
+
+void counters_add(Counters *into, const Counters *from)
+{
+    into->stats_issued += from->stats_issued;
+    into->stats_avoided += from->stats_avoided;
+    into->deleted += from->deleted;
+    into->delete_failed += from->delete_failed;
+    into->would_delete += from->would_delete;
+    into->dirs_opened += from->dirs_opened;
+    into->dirs_cached += from->dirs_cached;
+    into->denied_cached += from->denied_cached;
+    into->dirs_parked += from->dirs_parked;
+    into->dirs_reopened += from->dirs_reopened;
+    into->entries += from->entries;
+    into->bytes_reclaimed += from->bytes_reclaimed;
+    into->sized += from->sized;
+    into->allocations += from->allocations;
+    into->matched += from->matched;
+    into->error_count += from->error_count;
+    into->throttled += from->throttled;
+    into->throttle_ns += from->throttle_ns;
+    for (int i = 0; i < ERRNO_SLOTS; i++) {
+        into->errors[i] += from->errors[i];
+    }
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        into->wall_ns[p] += from->wall_ns[p];
+        into->cpu_ns[p] += from->cpu_ns[p];
+    }
+}
+
+// CPU quota of the cgroup the process runs in, in CPUs, or 0 without one.
+// With cgroup v2 every level from ours up to the root may set cpu.max
+// ("max" or "<quota> <period>"), and the lowest one applies. A container
+// usually sees its own cgroup as the root, which is covered by the last
+// step. Failing that, the cgroup v1 CFS quota of the cpu controller is
+// used as it is mounted inside containers.
+double cgroup_cpu_quota(void)
+{
+    double quota = 0;
+#ifdef __linux__
+    char line[PATH_MAX] = "";
+    char path[PATH_MAX + 32];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    bool v2 = false;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            v2 = true;
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    for (char *end = line + strlen(line); v2;) {
+        *end = '\0';
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+        long long max;
+        long long period;
+        if ((f = fopen(path, "r"))) {
+            if (fscanf(f, "%lld %lld", &max, &period) == 2 && max > 0 &&
+                    period > 0 && (!quota || (double)max / period < quota)) {
+                quota = (double)max / period;
+            }
+            fclose(f);
+        }
+        if (end == line + 3) {
+            break;
+        }
+        while (end > line + 3 && *--end != '/')
+            ;
+    }
+    if (!quota && (f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        long long max;
+        long long period = 0;
+        bool ok = fscanf(f, "%lld", &max) == 1;
+        fclose(f);
+        if (ok && max > 0 &&
+                (f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(f, "%lld", &period) == 1 && period > 0) {
+                quota = (double)max / period;
+            }
+            fclose(f);
+        }
+    }
+#endif
+    return quota;
+}
+
+// CPUs the process may use: those it is allowed to run on, or the cgroup
+// quota when that is lower.
+double cpu_limit(void)
+{
+    double cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = CPU_COUNT(&set);
+    }
+#endif
+    double quota = cgroup_cpu_quota();
+    if (quota > 0 && (quota < cpus || cpus < 1)) {
+        cpus = quota;
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+// -j auto. A tuner thread looks at the scan every AUTO_TICK_MS and moves
+// the number of active workers up or down, AIMD style. Throughput is
+// directories plus entries scanned per second; latency is the worker time
+// each of them took, which is mostly the getdents, stat and unlink calls
+// behind it. While there is queued work and the last step up paid off (or
+// the last step was not up), one more worker is let in. A step up that
+// did not raise throughput by AUTO_GAIN is taken back, and the next probe
+// waits AUTO_HOLD_TICKS. When latency climbs past AUTO_LATENCY_SLACK times
+// the best seen without throughput improving, the device is queueing
+// rather than working, and when the process uses nearly all the CPU it
+// may (cgroup cpu.max included), more workers only wait for a processor:
+// either way a quarter of the workers are parked. Ticks with too little
+// work done to measure are skipped.
+#define AUTO_JOBS_START 2
+#define AUTO_JOBS_PER_CPU 8
+#define AUTO_JOBS_MAX 64
+#define AUTO_TICK_MS 100
+#define AUTO_HOLD_TICKS 10
+#define AUTO_MIN_WORK 32
+#define AUTO_GAIN 1.05
+#define AUTO_LATENCY_SLACK 4
+#define AUTO_CPU_BUSY 0.9
+
+typedef struct {
+    Pool *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    uint64_t last_ns;
+    uint64_t last_cpu_ns;
+    unsigned long last_work;
+    uint64_t last_busy;
+    double last_rate;
+    double best_latency;
+    int last_step;
+    int hold; // ticks before the next step up
+} Tuner;
+
+uint64_t process_cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000u +
+            (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000u;
+}
+
+void tuner_set_active(Pool *pool, int active)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->active, active);
+    pthread_cond_broadcast(&pool->park_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (active > pool->active_peak) {
+        pool->active_peak = active;
+    }
+}
+
+void tuner_tick(Tuner *t)
+{
+    Pool *pool = t->pool;
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu_ns = process_cpu_ns();
+    unsigned long work = atomic_load_explicit(&pool->work_done,
+            memory_order_relaxed);
+    uint64_t busy = atomic_load_explicit(&pool->busy_ns, memory_order_relaxed);
+    unsigned long done = work - t->last_work;
+    if (done < AUTO_MIN_WORK) {
+        return;
+    }
+    double elapsed = (now - t->last_ns) / 1e9;
+    double rate = done / elapsed;
+    double latency = (busy - t->last_busy) / (double)done;
+    double cpus = (cpu_ns - t->last_cpu_ns) / 1e9 / elapsed;
+    t->last_ns = now;
+    t->last_cpu_ns = cpu_ns;
+    t->last_work = work;
+    t->last_busy = busy;
+
+    int active = atomic_load(&pool->active);
+    bool gained = rate > t->last_rate * AUTO_GAIN;
+    int floor = pool->lanes > 1 ? pool->lanes : 1;
+    int step = 0;
+    if ((cpus >= pool->opts->cpu_limit * AUTO_CPU_BUSY &&
+                active > pool->opts->cpu_limit) ||
+            (t->best_latency > 0 &&
+                    latency > t->best_latency * AUTO_LATENCY_SLACK &&
+                    !gained)) {
+        step = -(active / 4 > 1 ? active / 4 : 1);
+    } else if (t->last_step > 0 && !gained) {
+        step = -1;
+        t->hold = AUTO_HOLD_TICKS;
+    } else if (t->hold > 0) {
+        t->hold--;
+    } else if (atomic_load(&pool->queued) > 0 &&
+            cpus < pool->opts->cpu_limit * AUTO_CPU_BUSY) {
+        step = 1;
+    }
+    if (active + step < floor) {
+        step = floor - active;
+    } else if (active + step > pool->count) {
+        step = pool->count - active;
+    }
+    if (step) {
+        tuner_set_active(pool, active + step);
+    }
+    t->last_step = step;
+    t->last_rate = rate;
+    if (t->best_latency == 0 || latency < t->best_latency) {
+        t->best_latency = latency;
+    }
+}
+
+void *tuner_main(void *arg)
+{
+    Tuner *t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += AUTO_TICK_MS * 1000000l;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&t->cond, &t->lock, &deadline);
+        if (!t->stop) {
+            tuner_tick(t);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+bool tuner_start(Tuner *t, Pool *pool)
+{
+    *t = (Tuner){.pool = pool,
+            .last_ns = clock_ns(CLOCK_MONOTONIC),
+            .last_cpu_ns = process_cpu_ns(),
+            .last_work = atomic_load(&pool->work_done),
+            .last_busy = atomic_load(&pool->busy_ns)};
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    return pthread_create(&t->thread, NULL, tuner_main, t) == 0;
+}
+
+void tuner_stop(Tuner *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->stop = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+}
+
+bool pool_init(Pool *pool, const Options *opts)
+{
+    *pool = (Pool){.opts = opts, .count = opts->jobs, .lanes = 1};
+    pool->workers = calloc(pool->count, sizeof(*pool->workers));
+    if (!pool->workers) {
+        return false;
+    }
+    for (int i = 0; i < pool->count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+        pthread_mutex_init(&pool->workers[i].arena.lock, NULL);
+        atomic_init(&pool->workers[i].progress.depth, -1);
+    }
+    if (opts->delete_workers > 0 && !opts->dry_run) {
+        pool->deletes = delete_queue_new();
+        pool->deleters = calloc(opts->delete_workers, sizeof(Worker));
+        if (!pool->deletes || !pool->deleters) {
+            free(pool->deletes);
+            free(pool->deleters);
+            free(pool->workers);
+            return false;
+        }
+        pool->deleter_count = opts->delete_workers;
+        for (int i = 0; i < pool->deleter_count; i++) {
+            pool->deleters[i].pool = pool;
+            pool->deleters[i].id = i;
+            pthread_mutex_init(&pool->deleters[i].arena.lock, NULL);
+            atomic_init(&pool->deleters[i].progress.depth, -1);
+        }
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_cond_init(&pool->park_cond, NULL);
+    pthread_mutex_init(&pool->out.lock, NULL);
+    // -j auto starts small and leaves the rest to the tuner
+    pool->active_peak = opts->auto_jobs && pool->count > AUTO_JOBS_START
+            ? AUTO_JOBS_START : pool->count;
+    atomic_init(&pool->active, pool->active_peak);
+    pool->out.tty = isatty(STDOUT_FILENO);
+    return true;
+}
+
+void worker_free(Worker *w)
+{
+    cache_builder_free(&w->cache);
+    free(w->deque.items);
+    free(w->out.data);
+    free(w->path_buf);
+    free(w->read_buf);
+    free(w->park_buf);
+    free(w->sorted);
+    free(w->sorted_names);
+    arena_destroy(&w->arena);
+    free(w->review.items);
+    free(w->review.text);
+    plan_builder_free(&w->plan);
+    index_builder_free(&w->index);
+#ifdef __linux__
+    if (w->ring) {
+        io_ring_free(w->ring);
+    }
+#endif
+}
+
+// Adds up the counters of every worker.
+void pool_counters(const Pool *pool, Counters *totals)
+{
+    for (int i = 0; i < pool->count; i++) {
+        counters_add(totals, &pool->workers[i].counters);
+    }
+    for (int i = 0; i < pool->deleter_count; i++) {
+        counters_add(totals, &pool->deleters[i].counters);
+    }
+    totals->workers = atomic_load(&pool->active);
+    totals->workers_peak = pool->active_peak;
+}
+
+// Writes out whatever the workers still hold. Only called while no
+// worker is running.
+void pool_flush_output(Pool *pool)
+{
+    for (int i = 1; i < pool->count; i++) {
+        out_flush(&pool->workers[i], false);
+    }
+    for (int i = 0; i < pool->deleter_count; i++) {
+        out_flush(&pool->deleters[i], false);
+    }
+    out_flush(&pool->workers[0], true);
+}
+
+void pool_destroy(Pool *pool)
+{
+    pool_flush_output(pool);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        worker_free(&pool->workers[i]);
+    }
+    for (int i = 0; i < pool->deleter_count; i++) {
+        worker_free(&pool->deleters[i]);
+    }
+    for (int i = 0; i < pool->out.spare_count; i++) {
+        free(pool->out.spare[i].data);
+    }
+    pthread_mutex_destroy(&pool->out.lock);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->park_cond);
+    free(pool->workers);
+    free(pool->deleters);
+    free(pool->deletes);
+    visited_free(pool->visited);
+}
+
+// Runs every worker of the pool until the work that `seed` hands to worker
+// 0, and everything found from there, is done. The calling thread takes
+// part as worker 0, so -j 1 never starts a thread.
+void pool_run(Pool *pool, void (*seed)(Worker *, void *), void *arg)
+{
+    // Whatever worker 0 printed before the run (the starting path) goes
+    // ahead of the other workers' output
+    out_flush(&pool->workers[0], false);
+    // Deletion workers must all be running, or the scan could block on a
+    // full queue that nobody drains.
+    for (int i = 0; i < pool->deleter_count; i++) {
+        Worker *w = &pool->deleters[i];
+        if (pthread_create(&w->thread, NULL, deleter_main, w) != 0) {
+            fprintf(stderr, "Failed to start deletion worker: %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+    }
+    seed(&pool->workers[0], arg);
+    for (int i = 1; i < pool->count; i++) {
+        Worker *w = &pool->workers[i];
+        w->started = pthread_create(&w->thread, NULL, worker_main, w) == 0;
+    }
+    Tuner tuner;
+    bool tuning = pool->opts->auto_jobs && pool->count > 1 &&
+            tuner_start(&tuner, pool);
+    worker_main(&pool->workers[0]);
+    for (int i = 1; i < pool->count; i++) {
+        if (pool->workers[i].started) {
+            pthread_join(pool->workers[i].thread, NULL);
+            pool->workers[i].started = false;
+        }
+    }
+    if (tuning) {
+        tuner_stop(&tuner);
+    }
+
+    if (pool->deletes) {
+        atomic_store(&pool->deletes->closed, true);
+        for (int i = 0; i < pool->deleter_count; i++) {
+            pthread_join(pool->deleters[i].thread, NULL);
+        }
+        atomic_store(&pool->deletes->closed, false);
+    }
+    pool_flush_output(pool);
+}
+
+typedef struct {
+    const char *path;
+    dev_t dev;
+} ScanRoot;
+
+void seed_root(Worker *w, void *arg)
+{
+    const ScanRoot *root = arg;
+    DirNode *node = node_new(w, NULL, root->path);
+    if (!node) {
+        fprintf(stderr, "Memory allocation failed for '%s'.\n", root->path);
+        return;
+    }
+    node->root_dev = root->dev;
+    pool_push(w, node);
+}
+
+// Recursively deletes target files under `path`, including any
+// subdirectories.
+void remove_dsstore(Pool *pool, const char *path, dev_t root_dev)
+{
+    ScanRoot root = {path, root_dev};
+    pool_run(pool, seed_root, &root);
+}
+
+// Number of distinct devices among the starting paths.
+int count_devices(const ScanRoot *roots, int count)
+{
+    int devices = 0;
+    for (int i = 0; i < count; i++) {
+        int j = 0;
+        while (j < i && roots[j].dev != roots[i].dev) {
+            j++;
+        }
+        devices += j == i;
+    }
+    return devices;
+}
+
+typedef struct {
+    const ScanRoot *roots;
+    int count;
+} RootSet;
+
+// Hands the starting paths of device number `g` (in order of first
+// appearance) to worker g modulo the worker count. Each device's paths
+// are pushed last first, so they are still taken in the order given.
+void seed_roots(Worker *w, void *arg)
+{
+    const RootSet *set = arg;
+    Pool *pool = w->pool;
+    int *group = malloc(set->count * sizeof(*group));
+    if (!group) {
+        fprintf(stderr, "Memory allocation failed for paths.\n");
+        return;
+    }
+    int devices = 0;
+    for (int i = 0; i < set->count; i++) {
+        int j = 0;
+        while (j < i && set->roots[j].dev != set->roots[i].dev) {
+            j++;
+        }
+        group[i] = j < i ? group[j] : devices++;
+    }
+    for (int i = set->count; i-- > 0;) {
+        seed_root(&pool->workers[group[i] % pool->count],
+                (void *)&set->roots[i]);
+    }
+    free(group);
+}
+
+// Scans starting paths on several devices at once. Workers are split
+// into one lane per device (or one per worker when devices outnumber
+// them); a worker takes work from its own lane first and only helps other
+// lanes once its own has nothing queued, so a slow USB disk or NFS mount
+// ties up its own workers rather than everyone's.
+void remove_roots(Pool *pool, const ScanRoot *roots, int count, int devices)
+{
+    RootSet set = {roots, count};
+    pool->lanes = devices < pool->count ? devices : pool->count;
+    // -j auto tunes from one worker per device up
+    if (atomic_load(&pool->active) < pool->lanes) {
+        atomic_store(&pool->active, pool->lanes);
+        if (pool->lanes > pool->active_peak) {
+            pool->active_peak = pool->lanes;
+        }
+    }
+    if (pool->opts->verbose && !pool->opts->quiet) {
+        out_printf(&pool->workers[0],
+                "Scanning %d devices in parallel with %d workers\n", devices,
+                pool->count);
+    }
+    pool_run(pool, seed_roots, &set);
+    pool->lanes = 1;
+}
+
+// --progress. Workers only copy a few counters into relaxed atomics after
+// each directory; this thread adds them up every PROGRESS_TICK_MS and
+// redraws one status line on stderr. The path shown is that of the
+// deepest directory being scanned: the reporter asks its worker for it,
+// and shows it from the next tick on. When stderr is not a terminal, a
+// plain line is written every PROGRESS_LOG_MS instead.
+#define PROGRESS_TICK_MS 250
+#define PROGRESS_LOG_MS 5000
+
+typedef struct {
+    Pool *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    bool tty;
+    uint64_t last_ns;
+    unsigned long last_entries;
+    double rate;
+    char path[PROGRESS_PATH_MAX];
+} Reporter;
+
+// Writes the path of `node` to the reporter, keeping its end when it is
+// too long. The reference held on `node` keeps its ancestors alive too.
+void progress_path(Reporter *r, const DirNode *node)
+{
+    char *p = r->path + PROGRESS_PATH_MAX - 1;
+    *p = '\0';
+    for (const DirNode *n = node; n; n = n->parent) {
+        size_t len = strlen(n->name) + (n->parent ? 1 : 0);
+        if (len > (size_t)(p - r->path)) {
+            break;
+        }
+        p -= len;
+        if (n->parent) {
+            *p = '/';
+        }
+        memcpy(p + (n->parent ? 1 : 0), n->name, len - (n->parent ? 1 : 0));
+    }
+    memmove(r->path, p, r->path + PROGRESS_PATH_MAX - p);
+}
+
+// Adds up what the workers published and writes the status line, ending
+// it with a newline when `last`.
+void progress_draw(Reporter *r, bool last)
+{
+    Pool *pool = r->pool;
+    const Options *opts = pool->opts;
+    unsigned long dirs = 0;
+    unsigned long entries = 0;
+    unsigned long matched = 0;
+    unsigned long deleted = 0;
+    unsigned long errors = 0;
+    Worker *deepest = NULL;
+    int depth = -1;
+    for (int i = 0; i < pool->count + pool->deleter_count; i++) {
+        Worker *w = i < pool->count ? &pool->workers[i]
+                                    : &pool->deleters[i - pool->count];
+        Progress *p = &w->progress;
+        dirs += atomic_load_explicit(&p->dirs, memory_order_relaxed);
+        entries += atomic_load_explicit(&p->entries, memory_order_relaxed);
+        matched += atomic_load_explicit(&p->matched, memory_order_relaxed);
+        deleted += atomic_load_explicit(&p->deleted, memory_order_relaxed);
+        errors += atomic_load_explicit(&p->errors, memory_order_relaxed);
+        int d = atomic_load_explicit(&p->depth, memory_order_relaxed);
+        if (d > depth) {
+            depth = d;
+            deepest = w;
+        }
+    }
+    if (deepest) {
+        DirNode *node = atomic_exchange_explicit(&deepest->progress.node,
+                NULL, memory_order_acquire);
+        if (node) {
+            progress_path(r, node);
+            node_release(node);
+        }
+        atomic_store_explicit(&deepest->progress.want_path, true,
+                memory_order_relaxed);
+    }
+
+    // Entries per second, smoothed over the last few ticks
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    double rate = (entries - r->last_entries) * 1e9 /
+            (double)(now - r->last_ns + 1);
+    r->rate = r->last_entries ? (r->rate + rate) / 2 : rate;
+    r->last_ns = now;
+    r->last_entries = entries;
+
+    char line[PROGRESS_PATH_MAX + 160];
+    int len = snprintf(line, sizeof(line),
+            "%lu dirs, %.0f entries/s, %lu matched, %lu %s, %lu errors",
+            dirs, r->rate, matched, deleted,
+            opts->dry_run ? "to delete" : "deleted", errors);
+    int width = 80;
+    struct winsize ws;
+    if (r->tty && ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 &&
+            ws.ws_col > 0) {
+        width = ws.ws_col;
+    }
+    // Room permitting, the path, cut from the left to fit the terminal
+    int room = r->tty ? width - 1 - len - 2 : PROGRESS_PATH_MAX;
+    int path_len = strlen(r->path);
+    if (!last && r->path[0] && room > 4) {
+        const char *path = r->path;
+        const char *dots = "";
+        if (path_len > room) {
+            path += path_len - (room - 3);
+            dots = "...";
+        }
+        len += snprintf(line + len, sizeof(line) - len, "  %s%s", dots, path);
+    }
+    if (r->tty && len > width - 1) {
+        len = width - 1;
+    }
+
+    pthread_mutex_lock(&pool->out.lock);
+    if (r->tty) {
+        fprintf(stderr, "\r%.*s\033[K%s", len, line, last ? "\n" : "");
+        pool->out.progress_shown = !last;
+    } else {
+        fprintf(stderr, "%.*s\n", len, line);
+    }
+    fflush(stderr);
+    pthread_mutex_unlock(&pool->out.lock);
+}
+
+void *reporter_main(void *arg)
+{
+    Reporter *r = arg;
+    int interval = r->tty ? PROGRESS_TICK_MS : PROGRESS_LOG_MS;
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)interval * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&r->cond, &r->lock, &deadline);
+        bool last = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        progress_draw(r, last);
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+bool reporter_start(Reporter *r, Pool *pool)
+{
+    *r = (Reporter){.pool = pool,
+            .tty = isatty(STDERR_FILENO),
+            .last_ns = clock_ns(CLOCK_MONOTONIC)};
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return pthread_create(&r->thread, NULL, reporter_main, r) == 0;
+}
+
+// Stops the reporter after it has drawn the final counts.
+void reporter_stop(Reporter *r)
+{
+    // The workers are done; publish what they did since their last
+    // directory, such as errors opening one
+    Pool *pool = r->pool;
+    for (int i = 0; i < pool->count; i++) {
+        progress_publish(&pool->workers[i]);
+    }
+    for (int i = 0; i < pool->deleter_count; i++) {
+        progress_publish(&pool->deleters[i]);
+    }
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    for (int i = 0; i < pool->count; i++) {
+        node_release(atomic_exchange(&pool->workers[i].progress.node, NULL));
+    }
+}
+
+// Opens directory `path` one component at a time. The first `root_len`
+// bytes are the starting path it was found under, opened as a scan opens
+// one; every directory below it is opened with O_NOFOLLOW relative to the
+// one above, so paths may be longer than PATH_MAX and a symlink swapped
+// in for a directory is not followed.
+int open_dir_path(const char *path, size_t root_len)
+{
+    char *root = root_len ? strndup(path, root_len)
+                          : strdup(path[0] == '/' ? "/" : ".");
+    if (!root) {
+        return -1;
+    }
+    int fd = open_dir_at(AT_FDCWD, root, true);
+    free(root);
+    for (const char *p = path + root_len; fd != -1;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        size_t n = strcspn(p, "/");
+        char name[NAME_MAX + 1];
+        int next = -1;
+        if (n > NAME_MAX) {
+            errno = ENAMETOOLONG;
+        } else {
+            memcpy(name, p, n);
+            name[n] = '\0';
+            next = open_dir_at(fd, name, false);
+        }
+        int err = errno;
+        close(fd);
+        fd = next;
+        errno = err;
+        p += n;
+    }
+    return fd;
+}
+
+// Opens the directory of a scanned `node` again, one openat() per level
+// from its starting path, following a symlink only where the scan did.
+int open_node_again(const DirNode *node)
+{
+    size_t count = 0;
+    for (const DirNode *n = node; n; n = n->parent) {
+        count++;
+    }
+    const DirNode **chain = malloc(count * sizeof(*chain));
+    if (!chain) {
+        return -1;
+    }
+    size_t i = count;
+    for (const DirNode *n = node; n; n = n->parent) {
+        chain[--i] = n;
+    }
+    int fd = AT_FDCWD;
+    for (i = 0; i < count; i++) {
+        int next = open_dir_at(fd, chain[i]->name,
+                !chain[i]->parent || chain[i]->follow);
+        int err = errno;
+        if (fd != AT_FDCWD) {
+            close(fd);
+        }
+        fd = next;
+        errno = err;
+        if (fd == -1) {
+            break;
+        }
+    }
+    free(chain);
+    return fd;
+}
+
+// Checks that the directory reopened as `fd` after a scan is still the
+// one with device `dev` and inode `ino`. A directory renamed or replaced
+// in the meantime fails with ESTALE.
+int check_dir(int fd, dev_t dev, ino_t ino)
+{
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (fd != -1 && (st.st_dev != dev || st.st_ino != ino)) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+// Opens directory `path`, found under a starting path of `root_len`
+// bytes, again after a scan and checks it is still the planned one.
+int open_checked_dir(const char *path, size_t root_len, dev_t dev, ino_t ino)
+{
+    return check_dir(open_dir_path(path, root_len), dev, ino);
+}
+
+// -i: a candidate from any worker's list, with its answer.
+typedef struct {
+    const char *dir;
+    const char *name;
+    const Candidate *c;
+    bool approved;
+} ReviewItem;
+
+int cmp_review_item(const void *a, const void *b)
+{
+    const ReviewItem *x = a;
+    const ReviewItem *y = b;
+    int r = strcmp(x->dir, y->dir);
+    return r ? r : strcmp(x->name, y->name);
+}
+
+// Reads a line from stdin and returns its first character, or EOF.
+int read_answer(void)
+{
+    int answer = getchar();
+    for (int c = answer; c != '\n' && c != EOF;) {
+        c = getchar();
+    }
+    return answer == EOF ? EOF : tolower(answer);
+}
+
+// Deletes the approved candidates, one directory at a time. The
+// directory is reopened along the scanned chain and must still be the
+// one that was scanned; if it was renamed or replaced in the meantime,
+// its targets are reported as failed with ESTALE instead.
+void review_apply(Worker *w, const ReviewItem *items, size_t count)
+{
+    const Options *opts = w->pool->opts;
+    size_t end;
+    for (size_t i = 0; i < count; i = end) {
+        bool any = false;
+        for (end = i; end < count && strcmp(items[end].dir, items[i].dir) == 0;
+                end++) {
+            any |= items[end].approved;
+        }
+        if (!any) {
+            continue;
+        }
+        DirNode *node = node_new(w, NULL, items[i].dir);
+        if (!node) {
+            fprintf(stderr, "Memory allocation failed for '%s'.\n",
+                    items[i].dir);
+            continue;
+        }
+        int err = 0;
+        if (!opts->dry_run) {
+            node->fd = check_dir(open_node_again(items[i].c->node),
+                    items[i].c->dev, items[i].c->ino);
+            err = node->fd == -1 ? errno : 0;
+        }
+        for (size_t j = i; j < end; j++) {
+            if (!items[j].approved) {
+                continue;
+            }
+            if (opts->dry_run) {
+                w->counters.would_delete++;
+                count_reclaimed(w, items[j].c->bytes);
+                if (!opts->quiet) {
+                    emit(w, EV_WOULD_DELETE,
+                            format_path(w, node, items[j].name), 0);
+                }
+            } else if (err) {
+                report_unlink(w, node, items[j].name, 0, err);
+            } else {
+                io_unlink(w, node, items[j].name, items[j].c->bytes);
+            }
+        }
+        io_drain(w);
+        if (node->fd != -1) {
+            close(node->fd);
+        }
+        node_release(node);
+    }
+}
+
+// Drops the candidates' references on their scanned directories.
+void review_release(Pool *pool)
+{
+    for (int i = 0; i < pool->count; i++) {
+        CandidateList *list = &pool->workers[i].review;
+        for (size_t j = 0; j < list->count; j++) {
+            node_release(list->items[j].node);
+        }
+        list->count = 0;
+    }
+}
+
+// -i: once every path has been scanned, asks about the targets found, in
+// path order, so a long scan never waits on the user. Besides y and n,
+// d approves the rest of the directory, a everything left, and q (or the
+// end of input) stops asking and keeps whatever is left. The approved
+// targets are then deleted together.
+void review_run(Pool *pool)
+{
+    const Options *opts = pool->opts;
+    size_t count = 0;
+    for (int i = 0; i < pool->count; i++) {
+        count += pool->workers[i].review.count;
+    }
+    if (count == 0) {
+        return;
+    }
+    ReviewItem *items = malloc(count * sizeof(*items));
+    if (!items) {
+        fprintf(stderr, "Memory allocation failed for the review.\n");
+        review_release(pool);
+        return;
+    }
+    size_t n = 0;
+    for (int i = 0; i < pool->count; i++) {
+        const CandidateList *list = &pool->workers[i].review;
+        for (size_t j = 0; j < list->count; j++) {
+            const Candidate *c = &list->items[j];
+            items[n++] = (ReviewItem){list->text + c->dir,
+                    list->text + c->name, c, false};
+        }
+    }
+    qsort(items, count, sizeof(*items), cmp_review_item);
+    size_t dirs = 0;
+    for (size_t i = 0; i < count; i++) {
+        dirs += i == 0 || strcmp(items[i].dir, items[i - 1].dir) != 0;
+    }
+
+    // Machine-readable output keeps stdout to itself
+    FILE *prompt = opts->output == OUTPUT_TEXT ? stdout : stderr;
+    fprintf(prompt,
+            "Found %zu target%s in %zu director%s. Answer y or n for each, "
+            "d for the rest of its directory, a for all, q to stop.\n",
+            count, count == 1 ? "" : "s", dirs, dirs == 1 ? "y" : "ies");
+    const char *dir_yes = NULL;
+    bool all = false;
+    for (size_t i = 0; i < count; i++) {
+        ReviewItem *item = &items[i];
+        if (all || (dir_yes && strcmp(dir_yes, item->dir) == 0)) {
+            item->approved = true;
+            continue;
+        }
+        dir_yes = NULL;
+        fprintf(prompt, "Delete %s/%s? (y/N/d/a/q): ", item->dir, item->name);
+        fflush(prompt);
+        int answer = read_answer();
+        if (answer == EOF || answer == 'q') {
+            if (answer == EOF) {
+                fputc('\n', prompt);
+            }
+            break;
+        }
+        item->approved = answer == 'y' || answer == 'd' || answer == 'a';
+        if (answer == 'd') {
+            dir_yes = item->dir;
+        } else if (answer == 'a') {
+            all = true;
+        }
+    }
+    fflush(prompt);
+
+    review_apply(&pool->workers[0], items, count);
+    free(items);
+    review_release(pool);
+}
+
+// Deletes `name` from the directory `node` has open if it still has
+// device `dev` and inode `ino`, or with -n reports that it would. `err`
+// is the error from opening the directory, if any. A file replaced since
+// it was recorded is kept and reported with ESTALE.
+void unlink_checked(Worker *w, DirNode *node, const char *name, dev_t dev,
+        ino_t ino, int err)
+{
+    const Options *opts = w->pool->opts;
+    struct stat st;
+    if (!err) {
+        throttle(w, &ops_limit);
+        w->counters.stats_issued++;
+        uint64_t start = phase_start(w);
+        if (fstatat(node->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            err = errno;
+        } else if (st.st_dev != dev || st.st_ino != ino) {
+            err = ESTALE;
+        }
+        phase_end(w, PHASE_STAT, start);
+    }
+    if (err) {
+        report_unlink(w, node, name, 0, err);
+        return;
+    }
+    uint64_t bytes = st.st_nlink == 1 ? (uint64_t)st.st_blocks * 512 : 0;
+    if (opts->dry_run) {
+        w->counters.would_delete++;
+        count_reclaimed(w, bytes);
+        if (!opts->quiet) {
+            emit(w, EV_WOULD_DELETE, format_path(w, node, name), 0);
+        }
+    } else {
+        io_unlink(w, node, name, bytes);
+    }
+}
+
+// Checks that every offset and count in a mapped --plan file stays in
+// bounds and every name is a single NUL-terminated component, so a
+// damaged file is refused before anything is deleted.
+bool plan_valid(const void *map, size_t len)
+{
+    const PlanHeader *h = map;
+    if (len < sizeof(*h) || memcmp(h->magic, PLAN_MAGIC, 8) != 0 ||
+            h->version != PLAN_VERSION || h->entry_count > len ||
+            h->names_len > len ||
+            sizeof(*h) + (size_t)h->dir_count * sizeof(PlanDir) +
+                            h->entry_count * sizeof(PlanEntry) +
+                            h->names_len !=
+                    len) {
+        return false;
+    }
+    const PlanDir *dirs = (const PlanDir *)(h + 1);
+    const PlanEntry *entries = (const PlanEntry *)(dirs + h->dir_count);
+    const char *names = (const char *)(entries + h->entry_count);
+    for (uint32_t i = 0; i < h->dir_count; i++) {
+        const PlanDir *d = &dirs[i];
+        if ((uint64_t)d->path_offset + d->path_len >= h->names_len ||
+                names[d->path_offset + d->path_len] != '\0' ||
+                d->root_len > d->path_len ||
+                (uint64_t)d->entry_first + d->entry_count > h->entry_count) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < h->entry_count; i++) {
+        const PlanEntry *e = &entries[i];
+        const char *name = names + e->name_offset;
+        if ((uint64_t)e->name_offset + e->name_len >= h->names_len ||
+                name[e->name_len] != '\0' || e->name_len == 0 ||
+                memchr(name, '/', e->name_len) || strcmp(name, ".") == 0 ||
+                strcmp(name, "..") == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// --apply: deletes the targets listed in a --plan file without scanning
+// anything. Each directory must still be the one planned, and each
+// target is stated right before its unlinkat() and must still have the
+// planned device and inode; a file replaced since the plan was made is
+// kept and reported with ESTALE. With -n, lists what would be deleted.
+bool apply_plan(Pool *pool, const char *path)
+{
+    const Options *opts = pool->opts;
+    Worker *w = &pool->workers[0];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening plan '%s': %s\n", path,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t len = st.st_size;
+    void *map = len >= sizeof(PlanHeader)
+            ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)
+            : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || !plan_valid(map, len)) {
+        fprintf(stderr, "Invalid plan file '%s'.\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, len);
+        }
+        return false;
+    }
+
+    const PlanHeader *h = map;
+    const PlanDir *dirs = (const PlanDir *)(h + 1);
+    const PlanEntry *entries = (const PlanEntry *)(dirs + h->dir_count);
+    const char *names = (const char *)(entries + h->entry_count);
+    if (!opts->quiet) {
+        out_printf(w, "Applying plan %s: %lu targets in %u directories\n",
+                path, (unsigned long)h->entry_count, h->dir_count);
+    }
+    for (uint32_t i = 0; i < h->dir_count; i++) {
+        const PlanDir *d = &dirs[i];
+        DirNode *node = node_new(w, NULL, names + d->path_offset);
+        if (!node) {
+            fprintf(stderr, "Memory allocation failed for '%s'.\n",
+                    names + d->path_offset);
+            continue;
+        }
+        node->fd = open_checked_dir(node->name, d->root_len, d->dev, d->ino);
+        int dir_err = node->fd == -1 ? errno : 0;
+        for (uint32_t j = 0; j < d->entry_count; j++) {
+            const PlanEntry *e = &entries[d->entry_first + j];
+            unlink_checked(w, node, names + e->name_offset, d->dev, e->ino,
+                    dir_err);
+        }
+        io_drain(w);
+        if (node->fd != -1) {
+            close(node->fd);
+        }
+        node_release(node);
+    }
+    munmap(map, len);
+    return true;
+}
+
+// A position in a mapped --index-build file and the entry last decoded
+// there.
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+    unsigned char type;
+    unsigned char flags;
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    bool damaged;
+} IndexCursor;
+
+// Decodes the next entry. Returns false at the end of the data, or with
+// `damaged` set when a record does not fit.
+bool index_next(IndexCursor *c)
+{
+    uint64_t shared;
+    uint64_t suffix;
+    if (c->pos == c->end) {
+        return false;
+    }
+    if (!get_varint(&c->pos, c->end, &shared) ||
+            !get_varint(&c->pos, c->end, &suffix) || shared > c->path_len ||
+            suffix > (uint64_t)(c->end - c->pos) ||
+            (uint64_t)(c->end - c->pos) - suffix < 2) {
+        c->damaged = true;
+        return false;
+    }
+    size_t len = shared + suffix;
+    if (len + 1 > c->path_cap) {
+        size_t cap = len + 1 > 2 * c->path_cap ? len + 1 : 2 * c->path_cap;
+        char *grown = realloc(c->path, cap);
+        if (!grown) {
+            c->damaged = true;
+            return false;
+        }
+        c->path = grown;
+        c->path_cap = cap;
+    }
+    memcpy(c->path + shared, c->pos, suffix);
+    c->path[len] = '\0';
+    c->path_len = len;
+    c->pos += suffix;
+    c->type = *c->pos++;
+    c->flags = *c->pos++;
+    if (!get_varint(&c->pos, c->end, &c->size) ||
+            !get_varint(&c->pos, c->end, &c->ino) ||
+            !get_varint(&c->pos, c->end, &c->dev) || len == 0) {
+        c->damaged = true;
+        return false;
+    }
+    return true;
+}
+
+// Whether `path` is `prefix` itself or lies below it.
+bool path_under(const char *path, size_t len, const char *prefix,
+        size_t prefix_len)
+{
+    return len >= prefix_len && memcmp(path, prefix, prefix_len) == 0 &&
+            (len == prefix_len || path[prefix_len] == '/' ||
+                    (prefix_len > 0 && prefix[prefix_len - 1] == '/'));
+}
+
+// Positions `c` at the last restart point before `prefix`, from where
+// its subtree is reached by decoding forward.
+bool index_seek(IndexCursor *c, const unsigned char *data,
+        const uint64_t *restarts, uint64_t restart_count, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    uint64_t lo = 0;
+    uint64_t hi = restart_count;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const unsigned char *p = data + restarts[mid];
+        uint64_t shared;
+        uint64_t len;
+        if (restarts[mid] >= (uint64_t)(c->end - data) ||
+                !get_varint(&p, c->end, &shared) ||
+                !get_varint(&p, c->end, &len) || shared != 0 ||
+                len > (uint64_t)(c->end - p)) {
+            c->damaged = true;
+            return false;
+        }
+        if (path_order((const char *)p, len, prefix, prefix_len) < 0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    c->pos = data + (restart_count ? restarts[lo] : 0);
+    c->path_len = 0;
+    if (c->pos > c->end) {
+        c->damaged = true;
+        return false;
+    }
+    return true;
+}
+
+// The directory --from-index deletes from, kept open while the targets
+// that follow are in it too.
+typedef struct {
+    DirNode *node;
+    int err; // from opening it
+} IndexDir;
+
+void index_dir_close(Worker *w, IndexDir *dir)
+{
+    if (dir->node) {
+        io_drain(w);
+        if (dir->node->fd != -1) {
+            close(dir->node->fd);
+        }
+        node_release(dir->node);
+        dir->node = NULL;
+    }
+}
+
+// Starting paths of the index, known from the entries right in them, so
+// that --from-index opens only those the way a scan does.
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t cap;
+} IndexRoots;
+
+bool index_note_root(IndexRoots *roots, const IndexCursor *c)
+{
+    const char *slash = strrchr(c->path, '/');
+    size_t len = slash ? (size_t)(slash - c->path) + (slash == c->path) : 0;
+    if (roots->count > 0 &&
+            strlen(roots->paths[roots->count - 1]) == len &&
+            memcmp(roots->paths[roots->count - 1], c->path, len) == 0) {
+        return true;
+    }
+    if (roots->count == roots->cap) {
+        size_t cap = roots->cap ? roots->cap * 2 : 8;
+        char **grown = realloc(roots->paths, cap * sizeof(*grown));
+        if (!grown) {
+            return false;
+        }
+        roots->paths = grown;
+        roots->cap = cap;
+    }
+    if (!(roots->paths[roots->count] = strndup(c->path, len))) {
+        return false;
+    }
+    roots->count++;
+    return true;
+}
+
+// Length of the longest starting path, or query path, that the directory
+// of `dir_len` bytes in `path` lies under. 0 if there is none.
+size_t index_root_len(const IndexRoots *roots, const char *prefix,
+        size_t prefix_len, const char *path, size_t dir_len)
+{
+    size_t best = 0;
+    if (prefix && path_under(path, dir_len, prefix, prefix_len)) {
+        best = prefix_len;
+    }
+    for (size_t i = 0; i < roots->count; i++) {
+        size_t len = strlen(roots->paths[i]);
+        if (len > best && path_under(path, dir_len, roots->paths[i], len)) {
+            best = len;
+        }
+    }
+    return best;
+}
+
+// Handles one target found in the index. The directory is opened one
+// component at a time below the first `root_len` bytes of its path.
+void index_take(Worker *w, IndexDir *dir, IndexCursor *c, size_t root_len)
+{
+    const Options *opts = w->pool->opts;
+    if (opts->dry_run) {
+        w->counters.would_delete++;
+        count_reclaimed(w, c->size);
+        if (!opts->quiet) {
+            emit(w, EV_WOULD_DELETE, c->path, 0);
+        }
+        return;
+    }
+    char *slash = strrchr(c->path, '/');
+    if (!slash) {
+        return;
+    }
+    *slash = '\0';
+    if (!dir->node || strcmp(dir->node->name, c->path) != 0) {
+        index_dir_close(w, dir);
+        dir->node = node_new(w, NULL, c->path);
+        if (dir->node) {
+            dir->node->fd = open_dir_path(c->path, root_len);
+            dir->err = dir->node->fd == -1 ? errno : 0;
+        }
+    }
+    *slash = '/';
+    if (!dir->node) {
+        fprintf(stderr, "Memory allocation failed for '%s'.\n", c->path);
+        return;
+    }
+    // The device is the one recorded at build time, so a file of the same
+    // inode number on whatever is mounted there now is not taken for it
+    unlink_checked(w, dir->node, slash + 1, c->dev, c->ino, dir->err);
+}
+
+// --from-index: answers from an --index-build file instead of the disk.
+// With paths, only entries under them are looked at. Entries matching
+// the targets are listed as with -n, or without it, deleted after a
+// check that the file on disk is still the one indexed. When the targets
+// are the ones the index was built with, its match bits are used and no
+// name needs to be looked at.
+bool index_query(Pool *pool, const char *path, const char **prefixes,
+        int prefix_count)
+{
+    const Options *opts = pool->opts;
+    Worker *w = &pool->workers[0];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening index '%s': %s\n", path,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t len = st.st_size;
+    void *map = len >= sizeof(IndexHeader)
+            ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)
+            : MAP_FAILED;
+    close(fd);
+    const IndexHeader *h = map;
+    if (map == MAP_FAILED || memcmp(h->magic, INDEX_MAGIC, 8) != 0 ||
+            h->version != INDEX_VERSION || h->restart_count > len ||
+            h->data_len > len ||
+            sizeof(*h) + h->restart_count * sizeof(uint64_t) + h->data_len !=
+                    len) {
+        fprintf(stderr, "Invalid index file '%s'.\n", path);
+        if (map != MAP_FAILED) {
+            munmap(map, len);
+        }
+        return false;
+    }
+    const uint64_t *restarts = (const uint64_t *)(h + 1);
+    const unsigned char *data =
+            (const unsigned char *)(restarts + h->restart_count);
+    bool use_bits = h->config_hash == cache_config_hash(opts);
+
+    IndexCursor c = {.end = data + h->data_len};
+    IndexDir dir = {NULL, 0};
+    IndexRoots roots = {NULL, 0, 0};
+    for (int i = 0; i < (prefix_count ? prefix_count : 1) && !c.damaged;
+            i++) {
+        char *prefix = NULL;
+        size_t prefix_len = 0;
+        if (prefix_count) {
+            // Trailing slashes would never match the stored paths
+            prefix_len = strlen(prefixes[i]);
+            while (prefix_len > 1 && prefixes[i][prefix_len - 1] == '/') {
+                prefix_len--;
+            }
+            prefix = strndup(prefixes[i], prefix_len);
+            if (!prefix) {
+                fprintf(stderr, "Memory allocation failed for paths.\n");
+                break;
+            }
+            if (!index_seek(&c, data, restarts, h->restart_count, prefix)) {
+                free(prefix);
+                break;
+            }
+        } else {
+            c.pos = data;
+            c.path_len = 0;
+        }
+        while (index_next(&c)) {
+            if (prefix && !path_under(c.path, c.path_len, prefix, prefix_len)) {
+                if (path_order(c.path, c.path_len, prefix, prefix_len) > 0) {
+                    break;
+                }
+                continue;
+            }
+            if ((c.flags & INDEX_TOP) && !index_note_root(&roots, &c)) {
+                fprintf(stderr, "Memory allocation failed for paths.\n");
+                break;
+            }
+            const char *name = strrchr(c.path, '/');
+            name = name ? name + 1 : c.path;
+            if (c.type != DT_DIR &&
+                    (use_bits ? (c.flags & INDEX_MATCH) != 0
+                              : is_target(name, opts))) {
+                size_t dir_len = name > c.path ? (size_t)(name - c.path) - 1
+                                               : 0;
+                index_take(w, &dir, &c,
+                        index_root_len(&roots, prefix, prefix_len, c.path,
+                                dir_len));
+            }
+        }
+        free(prefix);
+    }
+    index_dir_close(w, &dir);
+    for (size_t i = 0; i < roots.count; i++) {
+        free(roots.paths[i]);
+    }
+    free(roots.paths);
+    if (c.damaged) {
+        fprintf(stderr, "Index file '%s' is damaged.\n", path);
+    }
+    free(c.path);
+    munmap(map, len);
+    return !c.damaged;
+}
+
+#ifdef __linux__
+// --watch. After the initial scan rmds keeps running and handles targets
+// as they are created. With CAP_SYS_ADMIN a fanotify group with
+// filesystem marks reports every creation on the filesystems holding the
+// starting paths, as a directory handle plus a name; names that are not
+// targets are dropped without resolving anything. Otherwise the scan
+// puts an inotify watch on every directory it opens, before reading it,
+// so the initial sync stays one normal scan and new directories get
+// theirs as they are scanned. Events are collected until the queue runs
+// dry or a batch is full, sorted so that duplicates fall away and each
+// directory is opened once, and then go through handle_entry() like
+// scanned entries. New directories are scanned in full, which also
+// catches anything created in them before their watch was in place.
+#define WATCH_BATCH 4096
+#define WATCH_READ_SIZE (64 * 1024)
+#define WATCH_KEY_MAX (8 + sizeof(struct file_handle) + MAX_HANDLE_SZ)
+
+// An inotify-watched directory, indexed by watch descriptor. Directories
+// are reached through the parent chain, so a renamed directory only needs
+// its own entry updated.
+typedef struct {
+    int parent; // -1 for a starting path
+    char *name; // the whole starting path for a root
+    int depth;
+    dev_t root_dev;
+    dev_t dev; // identity to check when reopening
+    ino_t ino;
+    int hash_next; // next in its bucket of Watcher.buckets, or -1
+    bool follow;   // reached through a symlink (-L)
+    bool active;
+} WatchDir;
+
+typedef struct {
+    unsigned char fsid[8];
+    int fd;
+} WatchMount;
+
+typedef struct {
+    unsigned char key[WATCH_KEY_MAX]; // fanotify: fsid and directory handle
+    size_t key_len;
+    int wd; // inotify
+    unsigned char type;
+    char name[NAME_MAX + 1];
+} WatchEvent;
+
+struct Watcher {
+    Pool *pool;
+    int fd;
+    int signal_fd;
+    bool fanotify;
+    pthread_mutex_t lock; // dirs and buckets, which the scan workers add to
+    const char **roots;
+    dev_t *root_devs;
+    char **real_roots;
+    int root_count;
+    WatchDir *dirs;
+    size_t dir_cap;
+    unsigned long watch_count;
+    int *buckets; // active directories by parent and name, chained
+    size_t bucket_count;
+    WatchMount *mounts;
+    size_t mount_count;
+    WatchEvent *events;
+    size_t event_count;
+    bool overflow;
+    bool limit_reported;
+};
+
+// Path of an inotify-watched directory, or NULL while one of its
+// ancestors is being moved. Only used to report it; directories are
+// opened with watch_open_dir().
+char *watch_dir_path(const Watcher *wt, int wd)
+{
+    size_t len = 0;
+    for (int d = wd; d != -1; d = wt->dirs[d].parent) {
+        if (!wt->dirs[d].active) {
+            return NULL;
+        }
+        len += strlen(wt->dirs[d].name) + 1;
+    }
+    char *path = len ? malloc(len) : NULL;
+    if (!path) {
+        return NULL;
+    }
+    char *p = path + len - 1;
+    *p = '\0';
+    for (int d = wd; d != -1; d = wt->dirs[d].parent) {
+        size_t n = strlen(wt->dirs[d].name);
+        p -= n;
+        memcpy(p, wt->dirs[d].name, n);
+        if (wt->dirs[d].parent != -1) {
+            *--p = '/';
+        }
+    }
+    return path;
+}
+
+// Opens an inotify-watched directory by walking down from its starting
+// path one openat() at a time, following symlinks only where the scan
+// did, and checks
+// each directory on the way is still the one that was watched. Returns -1
+// if one was moved or replaced; its own events bring the tree up to date.
+int watch_open_dir(const Watcher *wt, int wd)
+{
+    int count = 0;
+    for (int d = wd; d != -1; d = wt->dirs[d].parent) {
+        if (!wt->dirs[d].active) {
+            return -1;
+        }
+        count++;
+    }
+    int *chain = malloc(count * sizeof(*chain));
+    if (!chain) {
+        return -1;
+    }
+    int i = count;
+    for (int d = wd; d != -1; d = wt->dirs[d].parent) {
+        chain[--i] = d;
+    }
+
+    int fd = AT_FDCWD;
+    for (i = 0; i < count; i++) {
+        const WatchDir *d = &wt->dirs[chain[i]];
+        struct stat st;
+        int next = open_dir_at(fd, d->name, d->parent == -1 || d->follow);
+        if (fd != AT_FDCWD) {
+            close(fd);
+        }
+        fd = next;
+        if (fd == -1) {
+            break;
+        }
+        if (fstat(fd, &st) == -1 || st.st_dev != d->dev ||
+                st.st_ino != d->ino) {
+            close(fd);
+            fd = -1;
+            break;
+        }
+    }
+    free(chain);
+    return fd;
+}
+
+// Reports a directory that could not be watched, along with the limit
+// on watches the first time it is hit.
+void watch_error(Watcher *wt, int parent, const char *name, int err)
+{
+    char *parent_path = parent != -1 ? watch_dir_path(wt, parent) : NULL;
+    const char *dir = parent_path ? parent_path : "";
+    const char *sep = parent_path ? "/" : "";
+    if (err == ENOSPC && !wt->limit_reported) {
+        fprintf(stderr, "inotify watch limit reached at '%s%s%s'; raise "
+                        "fs.inotify.max_user_watches\n", dir, sep, name);
+        wt->limit_reported = true;
+    } else if (err != ENOSPC) {
+        fprintf(stderr, "Error watching '%s%s%s': %s\n", dir, sep, name,
+                strerror(err));
+    }
+    free(parent_path);
+}
+
+// Bucket of the directory `name` in `parent`. Renames and moves arrive as
+// such pairs, so looking one up does not depend on how many directories
+// are watched.
+size_t watch_bucket(const Watcher *wt, int parent, const char *name)
+{
+    uint32_t h = name_hash(name) ^ ((uint32_t)parent * 0x9e3779b1u);
+    return h & (wt->bucket_count - 1);
+}
+
+void watch_unlink(Watcher *wt, int wd)
+{
+    WatchDir *d = &wt->dirs[wd];
+    int *link = &wt->buckets[watch_bucket(wt, d->parent, d->name)];
+    while (*link != wd) {
+        link = &wt->dirs[*link].hash_next;
+    }
+    *link = d->hash_next;
+}
+
+// Puts an active directory in its bucket, first doubling the buckets if
+// there would be more directories than buckets.
+bool watch_link(Watcher *wt, int wd)
+{
+    if (wt->watch_count >= wt->bucket_count) {
+        size_t count = wt->bucket_count ? wt->bucket_count * 2 : 1024;
+        int *buckets = malloc(count * sizeof(*buckets));
+        if (!buckets) {
+            return false;
+        }
+        memset(buckets, 0xff, count * sizeof(*buckets));
+        free(wt->buckets);
+        wt->buckets = buckets;
+        wt->bucket_count = count;
+        for (size_t i = 0; i < wt->dir_cap; i++) {
+            WatchDir *d = &wt->dirs[i];
+            if (d->active && (int)i != wd) {
+                size_t b = watch_bucket(wt, d->parent, d->name);
+                d->hash_next = buckets[b];
+                buckets[b] = (int)i;
+            }
+        }
+    }
+    WatchDir *d = &wt->dirs[wd];
+    size_t b = watch_bucket(wt, d->parent, d->name);
+    d->hash_next = wt->buckets[b];
+    wt->buckets[b] = wd;
+    return true;
+}
+
+// Watches the directory open as `fd`, through /proc/self/fd so that no
+// path is looked up again. Adding a directory that is already watched
+// returns its old descriptor, whose entry is then moved to the new parent
+// and name.
+int watch_add(Watcher *wt, int fd, int parent, const char *name, int depth,
+        dev_t root_dev, bool follow)
+{
+    struct stat st;
+    char link[32];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    int wd = fstat(fd, &st) == -1 ? -1
+            : inotify_add_watch(wt->fd, link,
+                      IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR);
+    if (wd == -1) {
+        watch_error(wt, parent, name, errno);
+        return -1;
+    }
+    if ((size_t)wd >= wt->dir_cap) {
+        size_t cap = wt->dir_cap ? wt->dir_cap : 1024;
+        while (cap <= (size_t)wd) {
+            cap *= 2;
+        }
+        WatchDir *dirs = realloc(wt->dirs, cap * sizeof(*dirs));
+        if (!dirs) {
+            inotify_rm_watch(wt->fd, wd);
+            return -1;
+        }
+        memset(dirs + wt->dir_cap, 0, (cap - wt->dir_cap) * sizeof(*dirs));
+        wt->dirs = dirs;
+        wt->dir_cap = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy) {
+        inotify_rm_watch(wt->fd, wd);
+        return -1;
+    }
+    WatchDir *d = &wt->dirs[wd];
+    if (d->active) {
+        watch_unlink(wt, wd);
+        wt->watch_count--;
+    }
+    free(d->name);
+    *d = (WatchDir){.parent = parent, .name = copy, .depth = depth,
+            .root_dev = root_dev, .dev = st.st_dev, .ino = st.st_ino,
+            .follow = follow, .active = true};
+    if (!watch_link(wt, wd)) {
+        d->active = false;
+        inotify_rm_watch(wt->fd, wd);
+        return -1;
+    }
+    wt->watch_count++;
+    return wd;
+}
+
+void watch_drop(Watcher *wt, int wd)
+{
+    if (wd >= 0 && (size_t)wd < wt->dir_cap && wt->dirs[wd].active) {
+        watch_unlink(wt, wd);
+        wt->dirs[wd].active = false;
+        wt->watch_count--;
+    }
+}
+
+// Stops watching the subdirectory `name` of `parent` when it is moved
+// away. If it only moved within the tree, its arrival adds it again.
+void watch_forget_child(Watcher *wt, int parent, const char *name)
+{
+    if (!wt->bucket_count) {
+        return;
+    }
+    size_t b = watch_bucket(wt, parent, name);
+    for (int wd = wt->buckets[b]; wd != -1; wd = wt->dirs[wd].hash_next) {
+        const WatchDir *d = &wt->dirs[wd];
+        if (d->parent == parent && strcmp(d->name, name) == 0) {
+            inotify_rm_watch(wt->fd, wd);
+            watch_drop(wt, wd);
+            return;
+        }
+    }
+}
+
+// Watches a directory the scan has just opened, before it is read, so
+// nothing created in it afterwards goes unnoticed. A directory whose
+// parent could not be watched cannot be reached again and is left out.
+void watch_scanned_dir(Watcher *wt, DirNode *node, int fd)
+{
+    if (node->parent && node->parent->wd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wt->lock);
+    node->wd = watch_add(wt, fd, node->parent ? node->parent->wd : -1,
+            node->name, node->depth, node->root_dev, node->follow);
+    pthread_mutex_unlock(&wt->lock);
+}
+
+void watch_add_event(Watcher *wt, const void *key, size_t key_len, int wd,
+        const char *name, unsigned char type)
+{
+    WatchEvent *ev = &wt->events[wt->event_count++];
+    memcpy(ev->key, key, key_len);
+    ev->key_len = key_len;
+    ev->wd = wd;
+    ev->type = type;
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+}
+
+// Reads inotify events until none are left or the batch is full.
+void watch_read_inotify(Watcher *wt)
+{
+    alignas(struct inotify_event) char buf[WATCH_READ_SIZE];
+    while (wt->event_count < WATCH_BATCH) {
+        ssize_t n = read(wt->fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                wt->overflow = true;
+            } else if (ev->mask & IN_IGNORED) {
+                watch_drop(wt, ev->wd);
+            } else if (ev->len == 0 || ev->wd < 0 ||
+                    (size_t)ev->wd >= wt->dir_cap ||
+                    !wt->dirs[ev->wd].active) {
+                continue;
+            } else if (ev->mask & IN_MOVED_FROM) {
+                if (ev->mask & IN_ISDIR) {
+                    watch_forget_child(wt, ev->wd, ev->name);
+                }
+            } else if ((ev->mask & IN_ISDIR) || is_target(ev->name,
+                                                        wt->pool->opts)) {
+                watch_add_event(wt, NULL, 0, ev->wd, ev->name,
+                        ev->mask & IN_ISDIR ? DT_DIR : DT_REG);
+            }
+        }
+    }
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+// Reads fanotify events until none are left or the batch is full. Only
+// names that are targets are kept. Returns false on events this build
+// cannot parse.
+bool watch_read_fanotify(Watcher *wt)
+{
+    alignas(struct fanotify_event_metadata) char buf[WATCH_READ_SIZE];
+    while (wt->event_count < WATCH_BATCH) {
+        ssize_t n = read(wt->fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        struct fanotify_event_metadata *meta = (void *)buf;
+        for (; FAN_EVENT_OK(meta, n); meta = FAN_EVENT_NEXT(meta, n)) {
+            if (meta->vers != FANOTIFY_METADATA_VERSION) {
+                fprintf(stderr, "Unsupported fanotify event version.\n");
+                return false;
+            }
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                wt->overflow = true;
+                continue;
+            }
+            struct fanotify_event_info_fid *fid = (void *)(meta + 1);
+            if ((char *)(fid + 1) > (char *)meta + meta->event_len ||
+                    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            struct file_handle *fh = (void *)fid->handle;
+            const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+            if (fh->handle_bytes > MAX_HANDLE_SZ ||
+                    !is_target(name, wt->pool->opts)) {
+                continue;
+            }
+            unsigned char key[WATCH_KEY_MAX];
+            size_t fh_len = sizeof(*fh) + fh->handle_bytes;
+            memcpy(key, &fid->fsid, 8);
+            memcpy(key + 8, fh, fh_len);
+            watch_add_event(wt, key, 8 + fh_len, -1, name, DT_REG);
+        }
+    }
+    return true;
+}
+
+// Opens the directory of a fanotify event and works out which starting
+// path it lies under. Returns the descriptor, or -1 if it is outside
+// every starting path or in a part of the tree a scan would not enter.
+int watch_open_handle(Watcher *wt, const WatchEvent *ev, char **path,
+        int *depth, dev_t *root_dev)
+{
+    const Options *opts = wt->pool->opts;
+    int mount_fd = -1;
+    for (size_t i = 0; i < wt->mount_count; i++) {
+        if (memcmp(wt->mounts[i].fsid, ev->key, 8) == 0) {
+            mount_fd = wt->mounts[i].fd;
+            break;
+        }
+    }
+    struct file_handle *fh = (void *)(ev->key + 8);
+    int fd = mount_fd == -1 ? -1
+            : open_by_handle_at(mount_fd, fh,
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char link[32];
+    char real[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, real, sizeof(real) - 1);
+    if (len <= 0) {
+        close(fd);
+        return -1;
+    }
+    real[len] = '\0';
+
+    // The innermost starting path containing the directory
+    int root = -1;
+    size_t root_len = 0;
+    for (int i = 0; i < wt->root_count; i++) {
+        const char *r = wt->real_roots[i];
+        size_t rl = strlen(r);
+        if (!r[0] || rl < root_len || strncmp(real, r, rl) != 0) {
+            continue;
+        }
+        if (real[rl] == '\0' || real[rl] == '/' || (rl == 1 && r[0] == '/')) {
+            root = i;
+            root_len = rl;
+        }
+    }
+    if (root == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Each directory below the starting path must be one a scan enters
+    const char *rest = real + root_len;
+    *depth = 0;
+    for (const char *p = rest; *p;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        const char *end = strchr(p, '/');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        char component[NAME_MAX + 1];
+        if (n > NAME_MAX) {
+            close(fd);
+            return -1;
+        }
+        memcpy(component, p, n);
+        component[n] = '\0';
+        if (is_excluded(component, opts)) {
+            close(fd);
+            return -1;
+        }
+        (*depth)++;
+        p += n;
+    }
+    struct stat st;
+    if ((opts->max_depth != -1 && *depth > opts->max_depth) ||
+            (opts->one_file_system &&
+                    (fstat(fd, &st) == -1 ||
+                            st.st_dev != wt->root_devs[root]))) {
+        close(fd);
+        return -1;
+    }
+
+    // Report paths the way the starting path was given
+    size_t plen = strlen(wt->roots[root]) + strlen(rest) + 1;
+    *path = malloc(plen);
+    if (!*path) {
+        close(fd);
+        return -1;
+    }
+    snprintf(*path, plen, "%s%s", wt->roots[root],
+            root_len == 1 && rest[0] != '/' ? rest - 1 : rest);
+    *root_dev = wt->root_devs[root];
+    return fd;
+}
+
+// Marks the filesystem holding `path` and keeps a descriptor on it for
+// open_by_handle_at(). Filesystems are only marked once.
+bool watch_mark_fs(Watcher *wt, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct statfs sfs;
+    if (fd == -1 || fstatfs(fd, &sfs) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    for (size_t i = 0; i < wt->mount_count; i++) {
+        if (memcmp(wt->mounts[i].fsid, &sfs.f_fsid, 8) == 0) {
+            close(fd);
+            return true;
+        }
+    }
+    WatchMount *mounts =
+            realloc(wt->mounts, (wt->mount_count + 1) * sizeof(*mounts));
+    if (!mounts || fanotify_mark(wt->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                           FAN_CREATE | FAN_MOVED_TO, fd, NULL) == -1) {
+        if (mounts) {
+            wt->mounts = mounts;
+        }
+        close(fd);
+        return false;
+    }
+    wt->mounts = mounts;
+    memcpy(wt->mounts[wt->mount_count].fsid, &sfs.f_fsid, 8);
+    wt->mounts[wt->mount_count++].fd = fd;
+    return true;
+}
+
+// Undoes the octal escapes of /proc/self/mountinfo in place.
+void unescape_mount_path(char *s)
+{
+    char *d = s;
+    for (char *p = s; *p; p++) {
+        if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' && p[2] >= '0' &&
+                p[2] <= '7' && p[3] >= '0' && p[3] <= '7') {
+            *d++ = (char)((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0'));
+            p += 3;
+        } else {
+            *d++ = *p;
+        }
+    }
+    *d = '\0';
+}
+
+// Sets up fanotify for every starting path and, unless -x keeps the scan
+// on one filesystem, for the filesystems mounted below them.
+bool watch_init_fanotify(Watcher *wt)
+{
+    wt->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                    FAN_CLOEXEC | FAN_NONBLOCK,
+            O_RDONLY | O_CLOEXEC);
+    if (wt->fd == -1) {
+        return false;
+    }
+    for (int i = 0; i < wt->root_count; i++) {
+        if (wt->real_roots[i][0] && !watch_mark_fs(wt, wt->real_roots[i])) {
+            return false;
+        }
+    }
+    if (wt->pool->opts->one_file_system) {
+        return true;
+    }
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    if (!f) {
+        return true;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        // The mount point is the fifth field
+        char *save = NULL;
+        char *field = strtok_r(line, " ", &save);
+        for (int i = 1; field && i < 5; i++) {
+            field = strtok_r(NULL, " ", &save);
+        }
+        if (!field) {
+            continue;
+        }
+        unescape_mount_path(field);
+        for (int i = 0; i < wt->root_count; i++) {
+            const char *r = wt->real_roots[i];
+            size_t rl = strlen(r);
+            if (r[0] && strncmp(field, r, rl) == 0 &&
+                    (field[rl] == '/' || (rl == 1 && field[1]))) {
+                // Pseudo filesystems without file handles cannot be marked
+                watch_mark_fs(wt, field);
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+#endif
+
+int cmp_watch_event(const void *a, const void *b)
+{
+    const WatchEvent *x = a;
+    const WatchEvent *y = b;
+    if (x->key_len != y->key_len) {
+        return x->key_len < y->key_len ? -1 : 1;
+    }
+    int c = memcmp(x->key, y->key, x->key_len);
+    if (c != 0) {
+        return c;
+    }
+    if (x->wd != y->wd) {
+        return x->wd < y->wd ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+bool same_watch_dir(const WatchEvent *x, const WatchEvent *y)
+{
+    return x->wd == y->wd && x->key_len == y->key_len &&
+            memcmp(x->key, y->key, x->key_len) == 0;
+}
+
+// Hands a batch of events to worker 0: each directory is opened once and
+// its new entries go through handle_entry(), which deletes targets and
+// queues new subdirectories for the pool to scan.
+void seed_watch_events(Worker *w, void *arg)
+{
+    Watcher *wt = arg;
+    qsort(wt->events, wt->event_count, sizeof(*wt->events), cmp_watch_event);
+
+    for (size_t i = 0; i < wt->event_count;) {
+        size_t end = i + 1;
+        while (end < wt->event_count &&
+                same_watch_dir(&wt->events[i], &wt->events[end])) {
+            end++;
+        }
+
+        char *path = NULL;
+        int depth = 0;
+        dev_t root_dev = 0;
+        int fd = -1;
+        if (wt->fanotify) {
+#ifdef FAN_REPORT_DFID_NAME
+            fd = watch_open_handle(wt, &wt->events[i], &path, &depth,
+                    &root_dev);
+#endif
+        } else {
+            // Workers may be adding watches for directories queued by an
+            // earlier group
+            pthread_mutex_lock(&wt->lock);
+            if ((path = watch_dir_path(wt, wt->events[i].wd))) {
+                const WatchDir *d = &wt->dirs[wt->events[i].wd];
+                depth = d->depth;
+                root_dev = d->root_dev;
+                fd = watch_open_dir(wt, wt->events[i].wd);
+            }
+            pthread_mutex_unlock(&wt->lock);
+        }
+        DirNode *node = fd != -1 ? node_new(w, NULL, path) : NULL;
+        if (node) {
+            // New subdirectories are watched as they are scanned
+            node->wd = wt->fanotify ? -1 : wt->events[i].wd;
+            node->fd = fd;
+            atomic_store(&node->fd_refs, 1);
+            if (fd_budget) {
+                atomic_fetch_add(&open_dirs, 1);
+            }
+            node->depth = depth;
+            node->root_dev = root_dev;
+            for (size_t j = i; j < end; j++) {
+                const WatchEvent *ev = &wt->events[j];
+                if (j > i && strcmp(ev->name, wt->events[j - 1].name) == 0) {
+                    continue;
+                }
+                handle_entry(w, node, ev->name, ev->type, 0, NULL);
+            }
+            io_drain(w);
+            node_release_fd(node);
+            node_release(node);
+        } else if (fd != -1) {
+            close(fd);
+        }
+        free(path);
+        i = end;
+    }
+    wt->event_count = 0;
+}
+
+bool watch_init(Watcher *wt, Pool *pool, const char **roots, int count)
+{
+    *wt = (Watcher){.pool = pool, .fd = -1, .signal_fd = -1,
+            .roots = roots, .root_count = count};
+    pthread_mutex_init(&wt->lock, NULL);
+    wt->root_devs = calloc(count, sizeof(*wt->root_devs));
+    wt->real_roots = calloc(count, sizeof(*wt->real_roots));
+    wt->events = malloc((WATCH_BATCH + WATCH_READ_SIZE /
+                                 sizeof(struct inotify_event)) *
+            sizeof(*wt->events));
+    if (!wt->root_devs || !wt->real_roots || !wt->events) {
+        fprintf(stderr, "Memory allocation failed for the watcher.\n");
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        char *real = realpath(roots[i], NULL);
+        wt->real_roots[i] = real ? real : strdup("");
+        if (!wt->real_roots[i]) {
+            return false;
+        }
+        if (stat(roots[i], &st) == 0) {
+            wt->root_devs[i] = st.st_dev;
+        }
+    }
+
+#ifdef FAN_REPORT_DFID_NAME
+    if (watch_init_fanotify(wt)) {
+        wt->fanotify = true;
+        if (pool->opts->verbose && !pool->opts->quiet) {
+            out_printf(&pool->workers[0],
+                    "Watching %zu filesystem(s) with fanotify\n",
+                    wt->mount_count);
+        }
+        return true;
+    }
+    if (wt->fd != -1) {
+        close(wt->fd);
+    }
+    for (size_t i = 0; i < wt->mount_count; i++) {
+        close(wt->mounts[i].fd);
+    }
+    wt->mount_count = 0;
+#endif
+    wt->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wt->fd == -1) {
+        fprintf(stderr, "Error setting up inotify: %s\n", strerror(errno));
+        return false;
+    }
+    // The initial scan adds the watches
+    pool->watcher = wt;
+    return true;
+}
+
+// Handles events until SIGINT or SIGTERM arrives or the events cannot be
+// read. A queue overflow loses events, so everything is scanned again.
+void watch_run(Watcher *wt)
+{
+    // Signals end the watch through the event loop; the mask is inherited
+    // by every thread started from here on. Until now they were left
+    // alone, so the initial scan can still be interrupted.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    wt->signal_fd = signalfd(-1, &set, SFD_CLOEXEC);
+    if (wt->signal_fd == -1) {
+        fprintf(stderr, "Error setting up signal handling: %s\n",
+                strerror(errno));
+        return;
+    }
+
+    struct pollfd fds[2] = {
+            {.fd = wt->fd, .events = POLLIN},
+            {.fd = wt->signal_fd, .events = POLLIN}};
+    const Options *opts = wt->pool->opts;
+    if (!wt->fanotify && opts->verbose && !opts->quiet) {
+        out_printf(&wt->pool->workers[0],
+                "Watching %lu directories with inotify\n", wt->watch_count);
+    }
+    pool_flush_output(wt->pool);
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error waiting for events: %s\n", strerror(errno));
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+        if (wt->fanotify) {
+#ifdef FAN_REPORT_DFID_NAME
+            if (!watch_read_fanotify(wt)) {
+                return;
+            }
+#endif
+        } else {
+            watch_read_inotify(wt);
+        }
+        if (wt->pool->visited) {
+            visited_clear(wt->pool->visited);
+        }
+        if (wt->overflow) {
+            wt->overflow = false;
+            wt->event_count = 0;
+            for (int i = 0; i < wt->root_count; i++) {
+                if (!wt->real_roots[i][0]) {
+                    continue;
+                }
+                remove_dsstore(wt->pool, wt->roots[i], wt->root_devs[i]);
+            }
+        } else if (wt->event_count > 0) {
+            pool_run(wt->pool, seed_watch_events, wt);
+        }
+    }
+}
+
+void watch_free(Watcher *wt)
+{
+    wt->pool->watcher = NULL;
+    pthread_mutex_destroy(&wt->lock);
+    if (wt->fd != -1) {
+        close(wt->fd);
+    }
+    if (wt->signal_fd != -1) {
+        close(wt->signal_fd);
+    }
+    for (size_t i = 0; i < wt->dir_cap; i++) {
+        free(wt->dirs[i].name);
+    }
+    for (size_t i = 0; i < wt->mount_count; i++) {
+        close(wt->mounts[i].fd);
+    }
+    for (int i = 0; wt->real_roots && i < wt->root_count; i++) {
+        free(wt->real_roots[i]);
+    }
+    free(wt->dirs);
+    free(wt->buckets);
+    free(wt->mounts);
+    free(wt->real_roots);
+    free(wt->root_devs);
+    free(wt->events);
+}
+#endif
+
+// Lists the target name and patterns for the start-of-scan message.
+char *describe_targets(const Options *opts)
+{
+    size_t len = 1;
+    for (size_t i = 0; i < opts->targets.count; i++) {
+        len += strlen(opts->targets.names[i]) + 2;
+    }
+    for (int i = 0; i < opts->globs.pattern_count; i++) {
+        len += strlen(opts->globs.patterns[i]) + 2;
+    }
+    char *desc = malloc(len);
+    if (!desc) {
+        return NULL;
+    }
+    desc[0] = '\0';
+    for (size_t i = 0; i < opts->targets.count; i++) {
+        if (desc[0]) {
+            strcat(desc, ", ");
+        }
+        strcat(desc, opts->targets.names[i]);
+    }
+    for (int i = 0; i < opts->globs.pattern_count; i++) {
+        if (opts->globs.pattern_tags[i] & GLOB_TARGET) {
+            if (desc[0]) {
+                strcat(desc, ", ");
+            }
+            strcat(desc, opts->globs.patterns[i]);
+        }
+    }
+    return desc;
+}
+
+// Start-of-scan message for each starting path.
+void announce_root(Worker *w, const char *path, const char *target_desc)
+{
+    if (w->pool->opts->clean_all) {
+        out_printf(w, "Cleaning all metadata (.DS_Store and ._*) in: %s\n",
+                path);
+    } else {
+        out_printf(w, "Scanning for %s files in: %s\n", target_desc, path);
+    }
+    emit(w, EV_ROOT, path, 0);
+}
+
+void print_summary(Worker *w, const Counters *totals)
+{
+    const Options *opts = w->pool->opts;
+    if (opts->output == OUTPUT_JSON) {
+        char *p = out_reserve(w, 256);
+        if (p) {
+            int len = snprintf(p, 256,
+                    "{\"event\":\"summary\",\"deleted\":%lu,"
+                    "\"failed\":%lu,\"would_delete\":%lu,"
+                    "\"stats_issued\":%lu,\"stats_avoided\":%lu}\n",
+                    totals->deleted, totals->delete_failed,
+                    totals->would_delete, totals->stats_issued,
+                    totals->stats_avoided);
+            out_commit(w, len);
+        }
+    } else if (opts->verbose) {
+        if (opts->dry_run) {
+            out_printf(w, "Summary: %lu would be deleted\n",
+                    totals->would_delete);
+        } else {
+            out_printf(w, "Summary: %lu deleted, %lu failed\n",
+                    totals->deleted, totals->delete_failed);
+        }
+        out_printf(w, "Stat calls: %lu issued, %lu avoided via d_type\n",
+                totals->stats_issued, totals->stats_avoided);
+    }
+}
+
+static const char *const phase_names[PHASE_COUNT] = {
+        "readdir", "stat", "unlink"};
+
+// --stats report, written to stderr so it never mixes with the --print0
+// or --json stream. Phase times are summed over all threads.
+void print_stats(const Options *opts, const Counters *c, uint64_t wall_ns)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    long peak_kib = ru.ru_maxrss / 1024; // bytes on macOS
+#else
+    long peak_kib = ru.ru_maxrss;
+#endif
+
+    if (opts->stats == STATS_JSON) {
+        fprintf(stderr,
+                "{\"wall_s\":%.6f,\"user_s\":%.6f,\"system_s\":%.6f,"
+                "\"dirs_opened\":%lu,\"entries\":%lu,"
+                "\"dirs_cached\":%lu,\"denied_cached\":%lu,"
+                "\"dirs_parked\":%lu,\"dirs_reopened\":%lu,"
+                "\"stats_issued\":%lu,\"stats_avoided\":%lu,"
+                "\"deleted\":%lu,\"delete_failed\":%lu,"
+                "\"would_delete\":%lu,\"bytes_reclaimed\":%llu,\"sized\":%lu,"
+                "\"allocations\":%lu,\"workers\":%d,\"workers_peak\":%d,"
+                "\"throttled\":%lu,"
+                "\"throttle_wait_s\":%.6f,\"peak_rss_kib\":%ld,\"phases\":{",
+                wall_ns / 1e9, user, sys, c->dirs_opened, c->entries,
+                c->dirs_cached, c->denied_cached, c->dirs_parked,
+                c->dirs_reopened, c->stats_issued, c->stats_avoided,
+                c->deleted, c->delete_failed, c->would_delete, c->bytes_reclaimed,
+                c->sized, c->allocations, c->workers, c->workers_peak, c->throttled,
+                c->throttle_ns / 1e9, peak_kib);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(stderr, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}",
+                    p ? "," : "", phase_names[p], c->wall_ns[p] / 1e9,
+                    c->cpu_ns[p] / 1e9);
+        }
+        fprintf(stderr, "},\"errors\":{");
+        const char *sep = "";
+        for (int i = 0; i < ERRNO_SLOTS; i++) {
+            if (c->errors[i]) {
+                fprintf(stderr, "%s\"%d\":%lu", sep, i, c->errors[i]);
+                sep = ",";
+            }
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "Statistics:\n");
+    fprintf(stderr, "  Elapsed:             %.3f s wall, %.3f s user, "
+                    "%.3f s system\n", wall_ns / 1e9, user, sys);
+    fprintf(stderr, "  Directories opened:  %lu\n", c->dirs_opened);
+    if (opts->cache.path) {
+        fprintf(stderr, "  Unchanged (cached):  %lu, %lu denied skipped\n",
+                c->dirs_cached, c->denied_cached);
+    }
+    if (c->dirs_parked) {
+        fprintf(stderr, "  Parked (fd budget):  %lu, %lu reopened\n",
+                c->dirs_parked, c->dirs_reopened);
+    }
+    fprintf(stderr, "  Entries read:        %lu\n", c->entries);
+    fprintf(stderr, "  Stat calls:          %lu issued, %lu avoided\n",
+            c->stats_issued, c->stats_avoided);
+    if (opts->dry_run) {
+        fprintf(stderr, "  Would delete:        %lu (%llu bytes in %lu "
+                        "sized)\n", c->would_delete, c->bytes_reclaimed,
+                c->sized);
+    } else {
+        fprintf(stderr, "  Unlinks:             %lu deleted, %lu failed\n",
+                c->deleted, c->delete_failed);
+        fprintf(stderr, "  Bytes reclaimed:     %llu (%lu files sized)\n",
+                c->bytes_reclaimed, c->sized);
+    }
+    fprintf(stderr, "  Heap allocations:    %lu (workers)\n", c->allocations);
+    if (opts->auto_jobs) {
+        fprintf(stderr, "  Workers (-j auto):   %d at the end, %d at most, "
+                        "of %d (%.2f CPUs)\n", c->workers, c->workers_peak,
+                opts->jobs, opts->cpu_limit);
+    }
+    if (opts->max_ops_per_sec || opts->max_dirs_per_sec) {
+        fprintf(stderr, "  Throttle wait:       %.3f s (all threads, %lu waits)\n",
+                c->throttle_ns / 1e9, c->throttled);
+    }
+    fprintf(stderr, "  Peak RSS:            %ld KiB\n", peak_kib);
+    fprintf(stderr, "  Phase times (all threads, wall / CPU):\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(stderr, "    %-8s           %.3f s / %.3f s\n", phase_names[p],
+                c->wall_ns[p] / 1e9, c->cpu_ns[p] / 1e9);
+    }
+    bool any = false;
+    for (int i = 0; i < ERRNO_SLOTS; i++) {
+        if (c->errors[i]) {
+            if (!any) {
+                fprintf(stderr, "  Errors:\n");
+                any = true;
+            }
+            fprintf(stderr, "    %-3d %-30s %lu\n", i,
+                    i < ERRNO_SLOTS - 1 ? strerror(i) : "(other)",
+                    c->errors[i]);
+        }
+    }
+    if (!any) {
+        fprintf(stderr, "  Errors:              none\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts = {.dry_run = false,
+            .quiet = false,
+            .verbose = false,
+            .interactive = false,
+            .max_depth = -1,
+            .one_file_system = false,
+            .excludes = {0},
+            .targets = {{0}},
+            .clean_all = false,
+            .reader = DEFAULT_READER,
+            .jobs = 0,
+            .delete_workers = 0,
+            .io = IO_SYNC,
+            .queue_depth = 64,
+            .output = OUTPUT_TEXT,
+            .stats = STATS_OFF};
+
+    static struct option long_options[] = {{"clean-all", no_argument, 0, 'A'},
+            {"dry-run", no_argument, 0, 'n'}, {"quiet", no_argument, 0, 'q'},
+            {"verbose", no_argument, 0, 'v'},
+            {"interactive", no_argument, 0, 'i'},
+            {"max-depth", required_argument, 0, 'd'},
+            {"one-file-system", no_argument, 0, 'x'},
+            {"follow", no_argument, 0, 'L'},
+            {"max-fds", required_argument, 0, OPT_MAX_FDS},
+            {"exclude", required_argument, 0, 'e'},
+            {"exclude-from", required_argument, 0, OPT_EXCLUDE_FROM},
+            {"name", required_argument, 0, 'm'},
+            {"pattern", required_argument, 0, OPT_PATTERN},
+            {"exclude-pattern", required_argument, 0, OPT_EXCLUDE_PATTERN},
+            {"jobs", required_argument, 0, 'j'},
+            {"delete-workers", required_argument, 0, OPT_DELETE_WORKERS},
+            {"reader", required_argument, 0, OPT_READER},
+            {"sort-inode", no_argument, 0, OPT_SORT_INODE},
+            {"io", required_argument, 0, OPT_IO},
+            {"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+            {"print0", no_argument, 0, OPT_PRINT0},
+            {"json", no_argument, 0, OPT_JSON},
+            {"stats", optional_argument, 0, OPT_STATS},
+            {"cache", required_argument, 0, OPT_CACHE},
+            {"watch", no_argument, 0, OPT_WATCH},
+            {"plan", required_argument, 0, OPT_PLAN},
+            {"apply", required_argument, 0, OPT_APPLY},
+            {"index-build", required_argument, 0, OPT_INDEX_BUILD},
+            {"from-index", required_argument, 0, OPT_FROM_INDEX},
+            {"progress", no_argument, 0, OPT_PROGRESS},
+            {"max-ops-per-sec", required_argument, 0, OPT_MAX_OPS_PER_SEC},
+            {"max-dirs-per-sec", required_argument, 0, OPT_MAX_DIRS_PER_SEC},
+            {"idle", no_argument, 0, OPT_IDLE},
+            {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(
+                    argc, argv, "Anqvihd:xLe:m:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'A':
+            opts.clean_all = true;
+            break;
+        case 'n':
+            opts.dry_run = true;
+            break;
+        case 'q':
+            opts.quiet = true;
+            break;
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 'i':
+            opts.interactive = true;
+            break;
+        case 'd':
+            opts.max_depth = atoi(optarg);
+            break;
+        case 'x':
+            opts.one_file_system = true;
+            break;
+        case 'L':
+            opts.follow = true;
+            break;
+        case OPT_MAX_FDS:
+            opts.max_fds = atoi(optarg);
+            if (opts.max_fds < 1) {
+                fprintf(stderr, "Invalid descriptor budget '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (!name_set_add(&opts.excludes, optarg)) {
+                fprintf(stderr, "Memory allocation failed for excludes.\n");
+                return 1;
+            }
+            break;
+        case OPT_EXCLUDE_FROM:
+            if (!load_exclude_file(optarg, &opts)) {
+                return 1;
+            }
+            break;
+        case 'm':
+            if (!target_set_add(&opts.targets, optarg)) {
+                fprintf(stderr, "Memory allocation failed for targets.\n");
+                return 1;
+            }
+            break;
+        case OPT_PATTERN:
+        case OPT_EXCLUDE_PATTERN:
+            if (!glob_add(&opts.globs, optarg,
+                        opt == OPT_PATTERN ? GLOB_TARGET : GLOB_EXCLUDE)) {
+                fprintf(stderr, "Memory allocation failed for patterns.\n");
+                return 1;
+            }
+            if (opt == OPT_PATTERN) {
+                opts.has_target_patterns = true;
+            } else {
+                opts.has_exclude_patterns = true;
+            }
+            break;
+        case 'j':
+            opts.auto_jobs = strcmp(optarg, "auto") == 0;
+            opts.jobs = opts.auto_jobs ? 0 : atoi(optarg);
+            if (opts.jobs < 1 && !opts.auto_jobs) {
+                fprintf(stderr, "Invalid job count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_DELETE_WORKERS:
+            opts.delete_workers = atoi(optarg);
+            if (opts.delete_workers < 0) {
+                fprintf(stderr, "Invalid deletion worker count '%s'.\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case OPT_SORT_INODE:
+            opts.sort_inode = true;
+            break;
+        case OPT_READER:
+            if (strcmp(optarg, "readdir") == 0) {
+                opts.reader = READER_READDIR;
+#ifdef __linux__
+            } else if (strcmp(optarg, "getdents") == 0) {
+                opts.reader = READER_GETDENTS;
+#endif
+            } else {
+                fprintf(stderr, "Unsupported directory reader '%s'.\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case OPT_IO:
+            if (strcmp(optarg, "sync") == 0) {
+                opts.io = IO_SYNC;
+            } else if (strcmp(optarg, "uring") == 0) {
+                opts.io = IO_URING;
+            } else {
+                fprintf(stderr, "Unsupported I/O engine '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_QUEUE_DEPTH:
+            opts.queue_depth = atoi(optarg);
+            if (opts.queue_depth < 1 || opts.queue_depth > 4096) {
+                fprintf(stderr, "Invalid queue depth '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_PRINT0:
+            opts.output = OUTPUT_PRINT0;
+            break;
+        case OPT_JSON:
+            opts.output = OUTPUT_JSON;
+            break;
+        case OPT_STATS:
+            if (!optarg || strcmp(optarg, "human") == 0) {
+                opts.stats = STATS_HUMAN;
+            } else if (strcmp(optarg, "json") == 0) {
+                opts.stats = STATS_JSON;
+            } else {
+                fprintf(stderr, "Unsupported statistics format '%s'.\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case OPT_CACHE:
+            opts.cache.path = optarg;
+            break;
+        case OPT_WATCH:
+#ifdef __linux__
+            opts.watch = true;
+            break;
+#else
+            fprintf(stderr, "--watch is only supported on Linux.\n");
+            return 1;
+#endif
+        case OPT_PLAN:
+            opts.plan = optarg;
+            // A plan is made by a dry run
+            opts.dry_run = true;
+            break;
+        case OPT_APPLY:
+            opts.apply = optarg;
+            break;
+        case OPT_INDEX_BUILD:
+            opts.index_build = optarg;
+            opts.dry_run = true;
+            break;
+        case OPT_FROM_INDEX:
+            opts.from_index = optarg;
+            break;
+        case OPT_PROGRESS:
+            opts.progress = true;
+            break;
+        case OPT_MAX_OPS_PER_SEC:
+        case OPT_MAX_DIRS_PER_SEC: {
+            char *end;
+            long rate = strtol(optarg, &end, 10);
+            if (*end || rate < 1) {
+                fprintf(stderr, "Invalid rate '%s'.\n", optarg);
+                return 1;
+            }
+            *(opt == OPT_MAX_OPS_PER_SEC ? &opts.max_ops_per_sec
+                                         : &opts.max_dirs_per_sec) = rate;
+            break;
+        }
+        case OPT_IDLE:
+            opts.idle = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
         }
     }
 
-    free(opts.excludes);
-    return 0;
+    // An explicit --name or --pattern replaces the .DS_Store default
+    if ((opts.targets.count == 0 && !opts.has_target_patterns) ||
+            opts.clean_all) {
+        if (!target_set_add(&opts.targets, ".DS_Store")) {
+            fprintf(stderr, "Memory allocation failed for targets.\n");
+            return 1;
+        }
+    }
+    if (opts.globs.pattern_count > 0 && !glob_compile(&opts.globs)) {
+        fprintf(stderr, "Failed to compile glob patterns.\n");
+        return 1;
+    }
+    if (opts.watch && opts.interactive) {
+        fprintf(stderr, "--watch cannot be combined with --interactive.\n");
+        return 1;
+    }
+    if (opts.plan && (opts.watch || opts.interactive || opts.apply)) {
+        fprintf(stderr, "--plan cannot be combined with --watch, "
+                        "--interactive or --apply.\n");
+        return 1;
+    }
+    if (opts.apply && (opts.watch || opts.interactive || opts.cache.path ||
+                              opts.index_build || opts.from_index ||
+                              optind < argc)) {
+        fprintf(stderr, "--apply takes no paths and cannot be combined with "
+                        "--watch, --interactive, --cache or an index.\n");
+        return 1;
+    }
+    // An index needs every directory read, which --cache would skip
+    if ((opts.index_build || opts.from_index) &&
+            (opts.watch || opts.interactive || opts.cache.path ||
+                    opts.plan)) {
+        fprintf(stderr, "--index-build and --from-index cannot be combined "
+                        "with --watch,\n--interactive, --cache or "
+                        "--plan.\n");
+        return 1;
+    }
+    if (opts.index_build && opts.from_index) {
+        fprintf(stderr, "--index-build cannot be combined with "
+                        "--from-index.\n");
+        return 1;
+    }
+    char *target_desc = describe_targets(&opts);
+    if (!target_desc) {
+        fprintf(stderr, "Memory allocation failed for targets.\n");
+        return 1;
+    }
+
+    if (opts.cache.path &&
+            !cache_load(&opts.cache, opts.cache.path,
+                    cache_config_hash(&opts))) {
+        return 1;
+    }
+
+    // Parking takes park_lock around every directory open and release,
+    // which parallel scans would contend on, so it is only on when asked
+    fd_budget = opts.max_fds;
+
+    if (opts.idle) {
+        set_idle_priority();
+    }
+    if (opts.max_ops_per_sec) {
+        ops_limit.interval = 1000000000u / opts.max_ops_per_sec;
+        ops_limit.interval += !ops_limit.interval;
+    }
+    if (opts.max_dirs_per_sec) {
+        dirs_limit.interval = 1000000000u / opts.max_dirs_per_sec;
+        dirs_limit.interval += !dirs_limit.interval;
+    }
+
+    uint64_t started = clock_ns(CLOCK_MONOTONIC);
+
+    // Default to HOME if no paths provided
+    const char *home = NULL;
+    bool scanning = !opts.apply && !opts.from_index;
+    if (optind >= argc && scanning) {
+        home = getenv("HOME");
+        if (!home) {
+            fprintf(stderr, "Could not determine starting path ($HOME).\n");
+            return 1;
+        }
+    }
+    const char **paths = home ? &home : (const char **)argv + optind;
+    int path_count = home ? 1 : argc - optind;
+
+    ScanRoot *roots = malloc((path_count ? path_count : 1) * sizeof(*roots));
+    if (!roots) {
+        fprintf(stderr, "Memory allocation failed for paths.\n");
+        return 1;
+    }
+    int root_count = 0;
+    for (int i = 0; scanning && i < path_count; i++) {
+        struct stat root_stat;
+        if (stat(paths[i], &root_stat) == -1) {
+            if (home) {
+                fprintf(stderr, "Error stating starting path '%s': %s\n",
+                        home, strerror(errno));
+                return 1;
+            }
+            fprintf(stderr, "Error stating path '%s': %s\n", paths[i],
+                    strerror(errno));
+            continue;
+        }
+        roots[root_count++] = (ScanRoot){paths[i], root_stat.st_dev};
+    }
+    int devices = count_devices(roots, root_count);
+    // -j auto may go up to a few workers per CPU it can use, since most
+    // of their time is spent waiting for the disk
+    if (opts.auto_jobs) {
+        opts.cpu_limit = cpu_limit();
+        int cpus = (int)opts.cpu_limit;
+        cpus += cpus < opts.cpu_limit;
+        opts.jobs = cpus < AUTO_JOBS_MAX / AUTO_JOBS_PER_CPU
+                ? cpus * AUTO_JOBS_PER_CPU : AUTO_JOBS_MAX;
+        if (opts.jobs < devices) {
+            opts.jobs = devices;
+        }
+    }
+    // Without -j, each device gets a worker of its own
+    if (opts.jobs == 0) {
+        opts.jobs = devices > 1 ? devices : 1;
+    }
+
+    Pool pool;
+    if (!pool_init(&pool, &opts)) {
+        fprintf(stderr, "Memory allocation failed for workers.\n");
+        return 1;
+    }
+    // A single tree without symlinks cannot reach a directory twice
+    if ((opts.follow || path_count > 1) && !(pool.visited = visited_new())) {
+        fprintf(stderr, "Memory allocation failed for workers.\n");
+        return 1;
+    }
+
+#ifdef __linux__
+    // Watches go in before the scan so nothing created during it is missed
+    Watcher watcher;
+    if (opts.watch && !watch_init(&watcher, &pool, paths, path_count)) {
+        return 1;
+    }
+#endif
+
+    // Only the scan itself reports progress
+    Reporter reporter;
+    bool reporting = opts.progress && scanning &&
+            reporter_start(&reporter, &pool);
+    int status = 0;
+    if (opts.apply) {
+        status = apply_plan(&pool, opts.apply) ? 0 : 1;
+    } else if (opts.from_index) {
+        if (!opts.quiet) {
+            out_printf(&pool.workers[0], "Searching index %s\n",
+                    opts.from_index);
+        }
+        status = index_query(&pool, opts.from_index, paths, path_count)
+                ? 0 : 1;
+    } else if (devices > 1) {
+        if (!opts.quiet) {
+            for (int i = 0; i < root_count; i++) {
+                announce_root(&pool.workers[0], roots[i].path, target_desc);
+            }
+        }
+        remove_roots(&pool, roots, root_count, devices);
+    } else {
+        for (int i = 0; i < root_count; i++) {
+            if (!opts.quiet) {
+                announce_root(&pool.workers[0], roots[i].path, target_desc);
+            }
+            remove_dsstore(&pool, roots[i].path, roots[i].dev);
+        }
+    }
+    if (reporting) {
+        reporter_stop(&reporter);
+    }
+    if (opts.interactive) {
+        review_run(&pool);
+    }
+
+#ifdef __linux__
+    if (opts.watch) {
+        watch_run(&watcher);
+        watch_free(&watcher);
+    }
+#endif
+
+    if (opts.cache.path) {
+        cache_save(&pool, &opts.cache);
+    }
+    if (opts.plan && !plan_save(&pool, opts.plan)) {
+        status = 1;
+    }
+    if (opts.index_build && !index_save(&pool, opts.index_build)) {
+        status = 1;
+    }
+
+    Counters totals = {0};
+    pool_counters(&pool, &totals);
+    if (!opts.quiet) {
+        print_summary(&pool.workers[0], &totals);
+    }
+    pool_destroy(&pool);
+    if (opts.stats != STATS_OFF) {
+        print_stats(&opts, &totals, clock_ns(CLOCK_MONOTONIC) - started);
+    }
+
+    cache_free(&opts.cache);
+    name_set_free(&opts.excludes);
+    glob_free(&opts.globs);
+    target_set_free(&opts.targets);
+    free(target_desc);
+    free(roots);
+    return status;
 }
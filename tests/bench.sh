@@ -0,0 +1,165 @@
+#!/bin/bash
+
+# tests/bench.sh - Benchmarks rmds against find(1) on generated trees
+#
+# Each scenario's tree is generated once and its targets are put back
+# before every run, since both tools delete what they find. Results go to
+# stdout as a table and to $BENCH_OUT as one JSON object per tool, cache
+# state and scenario, so numbers from different releases can be compared.
+#
+# Environment:
+#   BENCH_OUT    results file (defaults to bench-results.ndjson)
+#   BENCH_DIR    where the trees are generated (defaults to $TMPDIR or /tmp)
+#   BENCH_RUNS   runs per tool and cache state (defaults to 3)
+#   BENCH_JOBS   worker threads for the parallel rmds runs (defaults to nproc)
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+RMDS=./rmds
+GEN=./tests/gen_tree
+OUT=${BENCH_OUT:-bench-results.ndjson}
+RUNS=${BENCH_RUNS:-3}
+JOBS=${BENCH_JOBS:-$(nproc 2>/dev/null || echo 4)}
+WORK=$(mktemp -d "${BENCH_DIR:-${TMPDIR:-/tmp}}/rmds-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+# name and generator arguments
+SCENARIOS=(
+    "wide|-f 8 -d 3 -n 16 -t 0.2"
+    "deep|-f 2 -d 11 -n 4 -t 0.2"
+    "huge|-f 0 -d 0 -n 0 -t 0.05 --huge 200000"
+)
+
+# name and command; TREE is replaced by the tree's path
+TOOLS=(
+    "rmds|$RMDS -q TREE"
+    "rmds -j $JOBS|$RMDS -q -j $JOBS TREE"
+    "rmds -j $JOBS --io uring|$RMDS -q -j $JOBS --io uring TREE"
+    "rmds --sort-inode|$RMDS -q --sort-inode TREE"
+    "find|find TREE -name .DS_Store -delete"
+)
+
+# Cold runs need to drop the page cache, which takes root
+CAN_DROP=false
+if sync && echo 3 2>/dev/null > /proc/sys/vm/drop_caches; then
+    CAN_DROP=true
+else
+    echo "Note: cannot drop caches, cold-cache runs are skipped." >&2
+fi
+
+# Syscalls are counted in a separate traced run when a tracer exists
+TRACER=none
+if command -v strace > /dev/null; then
+    TRACER=strace
+elif command -v perf > /dev/null &&
+        perf stat -e raw_syscalls:sys_enter true > /dev/null 2>&1; then
+    TRACER=perf
+else
+    echo "Note: neither strace nor perf available, syscalls not counted." >&2
+fi
+
+count_syscalls() {
+    local log="$WORK/trace.log"
+    case $TRACER in
+    strace)
+        strace -f -c -o "$log" "$@" > /dev/null
+        # % time, seconds, usecs/call, calls, errors (blank when there
+        # were none), syscall
+        awk '$NF == "total" { print $4 }' "$log"
+        ;;
+    perf)
+        perf stat -x, -e raw_syscalls:sys_enter -o "$log" "$@" > /dev/null
+        awk -F, '/raw_syscalls:sys_enter/ { print $1 }' "$log"
+        ;;
+    esac
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# Builds the scenario's tree, or with a second argument only puts back
+# the targets the previous run deleted.
+generate() {
+    if [ -z "$2" ]; then
+        rm -rf "$WORK/tree"
+    fi
+    # shellcheck disable=SC2086
+    $GEN $1 $2 "$WORK/tree"
+}
+
+: > "$OUT"
+printf "%-6s %-26s %-5s %12s %14s %10s\n" scenario tool cache seconds \
+    entries/sec sys/entry
+
+for scenario in "${SCENARIOS[@]}"; do
+    name=${scenario%%|*}
+    gen_args=${scenario#*|}
+    info=$(generate "$gen_args")
+    entries=$(echo "$info" | sed 's/.*"entries":\([0-9]*\).*/\1/')
+    ds_store=$(echo "$info" | sed 's/.*"ds_store":\([0-9]*\).*/\1/')
+
+    for tool in "${TOOLS[@]}"; do
+        label=${tool%%|*}
+        cmd=${tool#*|}
+        cmd=${cmd//TREE/$WORK/tree}
+
+        syscalls=null
+        if [ "$TRACER" != none ]; then
+            generate "$gen_args" --targets-only > /dev/null
+            # shellcheck disable=SC2086
+            total=$(count_syscalls $cmd)
+            if [ -n "$total" ]; then
+                syscalls=$(awk -v s="$total" -v e="$entries" \
+                    'BEGIN { printf "%.3f", s / e }')
+            fi
+        fi
+
+        for cache in warm cold; do
+            if [ $cache = cold ] && ! $CAN_DROP; then
+                continue
+            fi
+            times=()
+            for ((run = 1; run <= RUNS; run++)); do
+                generate "$gen_args" --targets-only > /dev/null
+                if [ $cache = cold ]; then
+                    sync
+                    echo 3 > /proc/sys/vm/drop_caches
+                fi
+                start=$(now_ns)
+                # shellcheck disable=SC2086
+                $cmd
+                end=$(now_ns)
+                left=$(find "$WORK/tree" -name .DS_Store | wc -l)
+                if [ "$left" -ne 0 ]; then
+                    echo "FAIL: $label left $left of $ds_store .DS_Store files" >&2
+                    exit 1
+                fi
+                times+=($((end - start)))
+            done
+
+            # Median run
+            median=$(printf "%s\n" "${times[@]}" | sort -n |
+                awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')
+            seconds=$(awk -v ns="$median" 'BEGIN { printf "%.4f", ns / 1e9 }')
+            rate=$(awk -v ns="$median" -v e="$entries" \
+                'BEGIN { printf "%.0f", e / (ns / 1e9) }')
+
+            printf "%-6s %-26s %-5s %12s %14s %10s\n" "$name" "$label" \
+                $cache "$seconds" "$rate" "$syscalls"
+            printf '{"version":"%s","scenario":"%s","generator":"%s",' \
+                "$VERSION" "$name" "$gen_args" >> "$OUT"
+            printf '"tool":"%s","cache":"%s","runs":%d,"entries":%d,' \
+                "$label" $cache "$RUNS" "$entries" >> "$OUT"
+            printf '"seconds":%s,"entries_per_sec":%s,' \
+                "$seconds" "$rate" >> "$OUT"
+            printf '"syscalls_per_entry":%s}\n' "$syscalls" >> "$OUT"
+        done
+    done
+done
+
+echo "Results written to $OUT"
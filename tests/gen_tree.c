@@ -0,0 +1,249 @@
+/*
+ * gen_tree.c - Deterministic directory tree generator for the rmds benchmarks
+ * Copyright (c) 2026, Vlad Shurupov. All rights reserved.
+ *
+ * Licensed under the 3-Clause BSD License.
+ * See the LICENSE file in the project root for full license text.
+ *
+ * Builds a tree of `fanout` subdirectories per level, `depth` levels deep,
+ * with `files` regular files in every directory. Each directory receives a
+ * .DS_Store and each file an AppleDouble ._ companion with probability
+ * `density`, drawn from a seeded generator so the same arguments always
+ * produce the same tree. With --huge N one extra directory holding N files
+ * is added at the top, the pathological case for directory readers.
+ * --targets-only recreates just the targets in a tree built earlier with
+ * the same arguments, which is all a benchmark run removes.
+ *
+ * Prints the number of directories, entries and targets (all of them, and
+ * the .DS_Store files alone) created as one JSON object.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    int fanout;
+    int depth;
+    int files;
+    double density;
+    long huge;
+    uint64_t seed;
+    bool targets_only;
+} Config;
+
+typedef struct {
+    unsigned long dirs;
+    unsigned long entries;
+    unsigned long targets;
+    unsigned long ds_store;
+} Totals;
+
+static uint64_t rng_state;
+
+// xorshift64*
+uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+bool rng_chance(double p)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+bool make_file(int dir_fd, const char *name, Totals *t)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+    close(fd);
+    t->entries++;
+    return true;
+}
+
+bool fill_dir(int dir_fd, const Config *cfg, long files, Totals *t)
+{
+    char name[64];
+    if (rng_chance(cfg->density)) {
+        if (!make_file(dir_fd, ".DS_Store", t)) {
+            return false;
+        }
+        t->targets++;
+        t->ds_store++;
+    }
+    for (long i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "file%ld.dat", i);
+        if (cfg->targets_only) {
+            t->entries++;
+        } else if (!make_file(dir_fd, name, t)) {
+            return false;
+        }
+        if (rng_chance(cfg->density)) {
+            snprintf(name, sizeof(name), "._file%ld.dat", i);
+            if (!make_file(dir_fd, name, t)) {
+                return false;
+            }
+            t->targets++;
+        }
+    }
+    return true;
+}
+
+int open_new_dir(int parent_fd, const char *name, Totals *t)
+{
+    if (mkdirat(parent_fd, name, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory '%s': %s\n", name,
+                strerror(errno));
+        return -1;
+    }
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening directory '%s': %s\n", name,
+                strerror(errno));
+        return -1;
+    }
+    t->dirs++;
+    t->entries++;
+    return fd;
+}
+
+bool build(int dir_fd, const Config *cfg, int level, Totals *t)
+{
+    if (!fill_dir(dir_fd, cfg, cfg->files, t)) {
+        return false;
+    }
+    if (level == cfg->depth) {
+        return true;
+    }
+    char name[32];
+    for (int i = 0; i < cfg->fanout; i++) {
+        snprintf(name, sizeof(name), "dir%d", i);
+        int fd = open_new_dir(dir_fd, name, t);
+        if (fd == -1) {
+            return false;
+        }
+        bool ok = build(fd, cfg, level + 1, t);
+        close(fd);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_usage(const char *progname)
+{
+    printf("Usage: %s [options] <root>\n", progname);
+    printf("\nOptions:\n");
+    printf("  -f, --fanout <N>       Subdirectories per directory (defaults "
+           "to 4)\n");
+    printf("  -d, --depth <N>        Levels below the root (defaults to 3)\n");
+    printf("  -n, --files <N>        Regular files per directory (defaults "
+           "to 8)\n");
+    printf("  -t, --density <P>      Probability of a .DS_Store per directory "
+           "and a ._\n"
+           "                         companion per file (defaults to 0.1)\n");
+    printf("      --huge <N>         Add a directory holding N files\n");
+    printf("  -s, --seed <N>         Random seed (defaults to 1)\n");
+    printf("  -T, --targets-only     Only recreate the targets of an existing "
+           "tree\n");
+    printf("  -h, --help             Display this help menu\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Config cfg = {.fanout = 4,
+            .depth = 3,
+            .files = 8,
+            .density = 0.1,
+            .huge = 0,
+            .seed = 1};
+
+    static struct option long_options[] = {
+            {"fanout", required_argument, 0, 'f'},
+            {"depth", required_argument, 0, 'd'},
+            {"files", required_argument, 0, 'n'},
+            {"density", required_argument, 0, 't'},
+            {"huge", required_argument, 0, 'H'},
+            {"seed", required_argument, 0, 's'},
+            {"targets-only", no_argument, 0, 'T'},
+            {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:d:n:t:s:Th", long_options, NULL))
+            != -1) {
+        switch (opt) {
+        case 'f':
+            cfg.fanout = atoi(optarg);
+            break;
+        case 'd':
+            cfg.depth = atoi(optarg);
+            break;
+        case 'n':
+            cfg.files = atoi(optarg);
+            break;
+        case 't':
+            cfg.density = atof(optarg);
+            break;
+        case 'H':
+            cfg.huge = atol(optarg);
+            break;
+        case 's':
+            cfg.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            cfg.targets_only = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || cfg.fanout < 0 || cfg.depth < 0 ||
+            cfg.files < 0 || cfg.huge < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Zero would stick the generator at zero
+    rng_state = cfg.seed ? cfg.seed : 0x9e3779b97f4a7c15ull;
+    Totals t = {0};
+    int root = open_new_dir(AT_FDCWD, argv[optind], &t);
+    if (root == -1) {
+        return 1;
+    }
+    bool ok = build(root, &cfg, 0, &t);
+    if (ok && cfg.huge > 0) {
+        int fd = open_new_dir(root, "huge", &t);
+        ok = fd != -1 && fill_dir(fd, &cfg, cfg.huge, &t);
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    close(root);
+    if (!ok) {
+        return 1;
+    }
+
+    printf("{\"dirs\":%lu,\"entries\":%lu,\"targets\":%lu,"
+           "\"ds_store\":%lu}\n",
+            t.dirs, t.entries, t.targets, t.ds_store);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * malloc_count.c - Heap allocation counter for the rmds tests
+ * Copyright (c) 2026, Vlad Shurupov. All rights reserved.
+ *
+ * Licensed under the 3-Clause BSD License.
+ * See the LICENSE file in the project root for full license text.
+ *
+ * Loaded with LD_PRELOAD, it counts every call that allocates from the
+ * heap, made by the program or by libc on its behalf, and passes it on
+ * to glibc's own allocator. At exit the total is written to stderr as
+ *
+ *   malloc_count: N
+ *
+ * so a test can compare runs without trusting the program's own counts.
+ * glibc only.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static atomic_ulong allocations;
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+    void *mem = memalign(align, size);
+    if (!mem) {
+        return ENOMEM;
+    }
+    *p = mem;
+    return 0;
+}
+
+// Written with write(2) so that reporting does not allocate
+__attribute__((destructor)) static void report(void)
+{
+    char line[64];
+    int len = snprintf(line, sizeof(line), "malloc_count: %lu\n",
+            atomic_load(&allocations));
+    if (write(STDERR_FILENO, line, len) < 0) {
+        return;
+    }
+}
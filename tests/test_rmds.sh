@@ -136,6 +136,544 @@ else
     exit 1
 fi
 
+# 11. Test d_type fast path
+setup_test_dir
+echo -n "Test 11: d_type stat avoidance... "
+OUTPUT=$(./rmds --verbose --dry-run "$TEST_DIR")
+if echo "$OUTPUT" | grep -Eq "Stat calls: [0-9]+ issued, [1-9][0-9]* avoided"; then
+    echo "PASS"
+else
+    echo "FAIL: No stat calls avoided"
+    echo "Output: $OUTPUT"
+    exit 1
+fi
+
+# 12. Test paths longer than PATH_MAX
+setup_test_dir
+echo -n "Test 12: Deep paths beyond 4096 bytes... "
+(
+    cd "$TEST_DIR"
+    for i in $(seq 1 120); do
+        mkdir deep_directory_component_padding_name
+        cd deep_directory_component_padding_name
+    done
+    touch .DS_Store
+)
+OUTPUT=$(./rmds "$TEST_DIR")
+DEEPEST=$(echo "$OUTPUT" | grep "Deleted: " | awk '{ print length($0) }' | sort -n | tail -1)
+if [ "$DEEPEST" -gt 4096 ] && ! echo "$OUTPUT" | grep -q "Error"; then
+    echo "PASS"
+else
+    echo "FAIL: Deep path not cleaned"
+    exit 1
+fi
+
+# 13. Test directory reader engines agree
+setup_test_dir
+touch "$TEST_DIR/nest1/nest2/._extra"
+echo -n "Test 13: Directory reader engines... "
+READERS="readdir"
+if [ "$(uname)" = "Linux" ]; then
+    READERS="$READERS getdents"
+fi
+EXPECTED=$(./rmds --dry-run --clean-all --reader readdir "$TEST_DIR" | sort)
+for reader in $READERS; do
+    OUTPUT=$(./rmds --dry-run --clean-all --reader "$reader" "$TEST_DIR" | sort)
+    if [ "$OUTPUT" != "$EXPECTED" ] || [ "$(echo "$OUTPUT" | grep -c "Would delete")" -ne 4 ]; then
+        echo "FAIL: Reader '$reader' disagrees"
+        echo "Output: $OUTPUT"
+        exit 1
+    fi
+done
+echo "PASS"
+
+# 14. Test parallel traversal matches the serial one
+setup_test_dir
+for d in a b c d; do
+    mkdir -p "$TEST_DIR/$d/x/y"
+    touch "$TEST_DIR/$d/.DS_Store" "$TEST_DIR/$d/x/.DS_Store" "$TEST_DIR/$d/x/y/._z"
+done
+echo -n "Test 14: Parallel jobs... "
+for flags in "-A" "-A -e x" "-A -d 2" "-x"; do
+    EXPECTED=$(./rmds --dry-run $flags "$TEST_DIR" | sort)
+    OUTPUT=$(./rmds --dry-run --jobs 4 $flags "$TEST_DIR" | sort)
+    if [ "$OUTPUT" != "$EXPECTED" ]; then
+        echo "FAIL: -j 4 $flags differs from serial run"
+        exit 1
+    fi
+done
+./rmds -q -j 4 -A "$TEST_DIR"
+if [ -z "$(find "$TEST_DIR" -name '.DS_Store' -o -name '._*')" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Parallel run left targets behind"
+    exit 1
+fi
+
+# 15. Test io_uring engine (falls back to sync where unavailable)
+setup_test_dir
+touch "$TEST_DIR/._a" "$TEST_DIR/nest1/._b" "$TEST_DIR/nest1/nest2/._c"
+echo -n "Test 15: io_uring engine... "
+EXPECTED=$(./rmds --dry-run -A -x "$TEST_DIR" | sort)
+OUTPUT=$(./rmds --dry-run -A -x --io uring --queue-depth 2 "$TEST_DIR" | sort)
+./rmds -A --io uring --queue-depth 2 "$TEST_DIR" > /dev/null
+if [ "$OUTPUT" = "$EXPECTED" ] && [ -z "$(find "$TEST_DIR" -name '.DS_Store' -o -name '._*')" ]; then
+    echo "PASS"
+else
+    echo "FAIL: io_uring engine differs from sync engine"
+    exit 1
+fi
+
+# 16. Test exclude list loaded from a file
+setup_test_dir
+mkdir -p "$TEST_DIR/keep"
+touch "$TEST_DIR/keep/.DS_Store"
+EXCLUDE_FILE="$TEST_DIR.excludes"
+{
+    echo "# policy excludes"
+    for i in $(seq 1 2000); do echo "cache_$i"; done
+    printf 'nest1\r\n'
+    echo ""
+} > "$EXCLUDE_FILE"
+echo -n "Test 16: Exclude from file... "
+./rmds --exclude-from "$EXCLUDE_FILE" -e keep "$TEST_DIR" > /dev/null
+if [ ! -f "$TEST_DIR/.DS_Store" ] && [ -f "$TEST_DIR/nest1/.DS_Store" ] && [ -f "$TEST_DIR/keep/.DS_Store" ] && ! ./rmds --exclude-from "$TEST_DIR.missing" "$TEST_DIR" > /dev/null 2>&1; then
+    echo "PASS"
+else
+    echo "FAIL: Exclude file not respected"
+    exit 1
+fi
+rm -f "$EXCLUDE_FILE"
+
+# 17. Test glob patterns against find -name
+setup_test_dir
+mkdir -p "$TEST_DIR/node_modules" "$TEST_DIR/build.cache"
+for f in a.tmp b.TMP Icon1 Icon12 notes.txt "x[1]" node_modules/c.tmp build.cache/d.tmp; do
+    touch "$TEST_DIR/$f"
+done
+echo -n "Test 17: Glob patterns... "
+for p in '*.tmp' 'Icon?' '[a-b].[tT]*' '*[[:digit:]]' 'x\[1]' '[!.]*.*'; do
+    OUTPUT=$(./rmds --dry-run --pattern "$p" "$TEST_DIR" | grep "Would delete" | sed 's/.*Would delete: //' | sort)
+    EXPECTED=$(find "$TEST_DIR" -type f -name "$p" | sort)
+    if [ "$OUTPUT" != "$EXPECTED" ]; then
+        echo "FAIL: Pattern '$p' differs from find"
+        exit 1
+    fi
+done
+./rmds --pattern '*.tmp' --pattern 'Icon?' --exclude-pattern 'node_*' --exclude-pattern '*.cache' "$TEST_DIR" > /dev/null
+if [ ! -f "$TEST_DIR/a.tmp" ] && [ ! -f "$TEST_DIR/Icon1" ] && [ -f "$TEST_DIR/Icon12" ] && [ -f "$TEST_DIR/.DS_Store" ] && [ -f "$TEST_DIR/node_modules/c.tmp" ] && [ -f "$TEST_DIR/build.cache/d.tmp" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Patterns not applied correctly"
+    exit 1
+fi
+
+# 18. Test several target names in one pass
+setup_test_dir
+for f in Thumbs.db desktop.ini desktop.inx .localized .localize Thumbs.d "$(printf 'x%.0s' $(seq 1 200))"; do
+    touch "$TEST_DIR/nest1/$f"
+done
+echo -n "Test 18: Multiple target names... "
+./rmds -m .DS_Store -m Thumbs.db -m desktop.ini -m .localized -m "$(printf 'x%.0s' $(seq 1 200))" "$TEST_DIR" > /dev/null
+if [ ! -f "$TEST_DIR/nest1/nest2/.DS_Store" ] && [ ! -f "$TEST_DIR/nest1/Thumbs.db" ] && [ ! -f "$TEST_DIR/nest1/desktop.ini" ] && [ ! -f "$TEST_DIR/nest1/.localized" ] && [ -z "$(ls "$TEST_DIR/nest1" | grep '^xxx')" ] && [ -f "$TEST_DIR/nest1/desktop.inx" ] && [ -f "$TEST_DIR/nest1/.localize" ] && [ -f "$TEST_DIR/nest1/Thumbs.d" ] && [ -f "$TEST_DIR/safe_file.txt" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Target name set not applied correctly"
+    exit 1
+fi
+
+# 19. Test background deletion workers
+setup_test_dir
+for d in a b c; do
+    mkdir -p "$TEST_DIR/$d"
+    for i in $(seq 1 50); do touch "$TEST_DIR/$d/._$i"; done
+done
+echo -n "Test 19: Deletion workers... "
+DRY=$(./rmds -v -n -A --delete-workers 2 "$TEST_DIR" | grep "Summary:")
+OUTPUT=$(./rmds -v -A -j 2 --delete-workers 2 "$TEST_DIR")
+if [ "$DRY" = "Summary: 153 would be deleted" ] && echo "$OUTPUT" | grep -q "Summary: 153 deleted, 0 failed" && [ "$(echo "$OUTPUT" | grep -c "^Deleted: ")" -eq 153 ] && [ -z "$(find "$TEST_DIR" -name '.DS_Store' -o -name '._*')" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Pipelined deletion report inaccurate"
+    exit 1
+fi
+
+# 20. Test the machine-readable output modes
+setup_test_dir
+mkdir -p "$TEST_DIR/with space" "$TEST_DIR/quo\"te"
+touch "$TEST_DIR/with space/.DS_Store" "$TEST_DIR/quo\"te/.DS_Store"
+echo -n "Test 20: --print0 and --json output... "
+PRINT0=$(./rmds -n --print0 "$TEST_DIR" | tr '\0' '\n' | sort)
+EXPECTED=$(find "$TEST_DIR" -name .DS_Store | sort)
+JSON=$(./rmds -j 2 --json "$TEST_DIR")
+if [ "$PRINT0" = "$EXPECTED" ] && [ "$(echo "$JSON" | grep -c '^{"event":"deleted","path":"')" -eq 5 ] && echo "$JSON" | grep -qF '"path":"'"$TEST_DIR"'/quo\"te/.DS_Store"' && echo "$JSON" | grep -q '^{"event":"summary","deleted":5,"failed":0,' && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Machine-readable output incorrect"
+    exit 1
+fi
+
+# 21. Test --stats counters
+setup_test_dir
+head -c 8192 /dev/urandom > "$TEST_DIR/nest1/.DS_Store"
+echo -n "Test 21: --stats report... "
+HUMAN=$(./rmds -n --stats "$TEST_DIR" 2>&1 >/dev/null)
+PLANNED=$(./rmds -q --plan "$TEST_DIR.plan" --stats=json "$TEST_DIR" 2>&1)
+JSON=$(./rmds -q --stats=json "$TEST_DIR" 2>&1)
+rm -f "$TEST_DIR.plan"
+if echo "$HUMAN" | grep -q "Directories opened:  3" && echo "$HUMAN" | grep -q "Entries read:        7" && echo "$JSON" | grep -q '"dirs_opened":3,"entries":7,' && echo "$JSON" | grep -q '"stats_issued":0,' && echo "$JSON" | grep -q '"deleted":3,"delete_failed":0,' && echo "$PLANNED" | grep -q '"bytes_reclaimed":[1-9][0-9]*,"sized":3,' && echo "$JSON" | grep -q '"unlink":{"wall_s":'; then
+    echo "PASS"
+else
+    echo "FAIL: Statistics report incorrect"
+    exit 1
+fi
+
+# 22. Test the incremental cache
+setup_test_dir
+rm -f "$TEST_DIR.cache"
+echo -n "Test 22: --cache skips unchanged directories... "
+./rmds -q --cache "$TEST_DIR.cache" "$TEST_DIR"
+touch -d '2020-01-01' "$TEST_DIR" "$TEST_DIR/nest1" "$TEST_DIR/nest1/nest2"
+./rmds -q --cache "$TEST_DIR.cache" "$TEST_DIR"
+SECOND=$(./rmds -q --cache "$TEST_DIR.cache" --stats=json "$TEST_DIR" 2>&1)
+touch "$TEST_DIR/nest1/nest2/.DS_Store"
+THIRD=$(./rmds -q --cache "$TEST_DIR.cache" --stats=json "$TEST_DIR" 2>&1)
+if echo "$SECOND" | grep -q '"entries":0,"dirs_cached":3,' && echo "$THIRD" | grep -q '"dirs_cached":2,' && echo "$THIRD" | grep -q '"deleted":1,' && [ ! -f "$TEST_DIR/nest1/nest2/.DS_Store" ] && [ -f "$TEST_DIR/safe_file.txt" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Cache did not skip unchanged directories correctly"
+    exit 1
+fi
+rm -f "$TEST_DIR.cache"
+
+# 23. Test watch mode (Linux only)
+if [ "$(uname -s)" = Linux ]; then
+    setup_test_dir
+    echo -n "Test 23: --watch deletes new targets... "
+    ./rmds -v --watch "$TEST_DIR" > "$TEST_DIR.log" 2>&1 &
+    WATCH_PID=$!
+    sleep 0.5
+    mkdir -p "$TEST_DIR/new/deeper"
+    touch "$TEST_DIR/.DS_Store" "$TEST_DIR/nest1/.DS_Store" "$TEST_DIR/new/deeper/.DS_Store" "$TEST_DIR/new/keep.txt"
+    for _ in 1 2 3 4 5 6 7 8 9 10; do
+        [ -z "$(find "$TEST_DIR" -name .DS_Store)" ] && break
+        sleep 0.2
+    done
+    kill -TERM $WATCH_PID
+    wait $WATCH_PID
+    STATUS=$?
+    if [ $STATUS -eq 0 ] && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ] && [ -f "$TEST_DIR/new/keep.txt" ] && grep -q "Summary: 6 deleted, 0 failed" "$TEST_DIR.log"; then
+        echo "PASS"
+    else
+        echo "FAIL: Watch mode missed targets or did not exit cleanly"
+        cat "$TEST_DIR.log"
+        exit 1
+    fi
+    rm -f "$TEST_DIR.log"
+
+    # SIGTERM must still stop the initial scan (a background job ignores
+    # SIGINT here)
+    ./rmds -q --watch --max-dirs-per-sec 2 "$TEST_DIR" &
+    WATCH_PID=$!
+    sleep 0.2
+    kill -TERM $WATCH_PID
+    sleep 0.5
+    if kill -0 $WATCH_PID 2> /dev/null; then
+        kill -KILL $WATCH_PID
+        echo "FAIL: --watch ignored SIGTERM during the initial scan"
+        exit 1
+    fi
+    wait $WATCH_PID || true
+fi
+
+# 24. Test overlapping paths and symlink following
+setup_test_dir
+mkdir -p "$TEST_DIR2"
+touch "$TEST_DIR2/.DS_Store"
+ln -s .. "$TEST_DIR/nest1/nest2/loop"
+ln -s "../$TEST_DIR2" "$TEST_DIR/outside"
+echo -n "Test 24: Overlapping paths and --follow... "
+OVERLAP=$(./rmds -v -n "$TEST_DIR/nest1" "$TEST_DIR" "$TEST_DIR/nest1/nest2")
+NOFOLLOW=$(./rmds -v -n -j 2 "$TEST_DIR" | grep "Summary:")
+FOLLOW=$(./rmds -v -L -j 2 "$TEST_DIR")
+if echo "$OVERLAP" | grep -q "Summary: 3 would be deleted" && [ "$(echo "$OVERLAP" | grep -c "^Skipping (already scanned): ")" -eq 2 ] && [ "$NOFOLLOW" = "Summary: 3 would be deleted" ] && echo "$FOLLOW" | grep -q "Summary: 4 deleted, 0 failed" && echo "$FOLLOW" | grep -q "^Skipping (already scanned): $TEST_DIR/nest1/nest2/loop$" && [ ! -f "$TEST_DIR2/.DS_Store" ] && [ -L "$TEST_DIR/outside" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Directories scanned more than once or links not followed"
+    exit 1
+fi
+
+# 25. Test the descriptor budget
+rm -rf "$TEST_DIR" "$TEST_DIR2"
+mkdir -p "$TEST_DIR/a/c" "$TEST_DIR/a/d" "$TEST_DIR/b/c" "$TEST_DIR/b/d"
+for dir in "$TEST_DIR" "$TEST_DIR"/a "$TEST_DIR"/b "$TEST_DIR"/*/c "$TEST_DIR"/*/d; do
+    touch "$dir/.DS_Store"
+done
+echo -n "Test 25: --max-fds parks and reopens directories... "
+STATS=$(./rmds -q -n --max-fds 1 --stats=json "$TEST_DIR" 2>&1)
+OUTPUT=$(./rmds -v -j 2 --max-fds 1 "$TEST_DIR" 2>&1)
+if echo "$STATS" | grep -q '"dirs_opened":7,' && echo "$STATS" | grep -q '"would_delete":7,' && echo "$STATS" | grep -q '"dirs_parked":[1-9][0-9]*,"dirs_reopened":[1-9]' && echo "$OUTPUT" | grep -q "Summary: 7 deleted, 0 failed" && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Descriptor budget broke the scan"
+    exit 1
+fi
+
+# 26. Test inode-ordered scanning
+setup_test_dir
+mkdir -p "$TEST_DIR/x" "$TEST_DIR/y" "$TEST_DIR/z"
+touch "$TEST_DIR/x/.DS_Store" "$TEST_DIR/z/._file"
+echo -n "Test 26: --sort-inode visits entries by inode... "
+EXPECTED=$(cd "$TEST_DIR" && ls -id nest1 x y z | sort -n | awk '{ print $2 }' | tr '\n' ' ')
+ORDER=$(./rmds -v -n --sort-inode -d 1 "$TEST_DIR" | sed -n "s|^Scanning: $TEST_DIR/||p" | tr '\n' ' ')
+OUTPUT=$(./rmds -v -A -j 2 --sort-inode "$TEST_DIR")
+if [ "$ORDER" = "$EXPECTED" ] && echo "$OUTPUT" | grep -q "Summary: 5 deleted, 0 failed" && [ -z "$(find "$TEST_DIR" -name '.DS_Store' -o -name '._*')" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Entries not handled in inode order"
+    exit 1
+fi
+
+# 27. Test concurrent scanning of paths on different devices
+OTHER_DEV_DIR=/dev/shm/rmds_test_$$
+if mkdir -p "$OTHER_DEV_DIR/sub" 2>/dev/null && [ "$(stat -c %d "$OTHER_DEV_DIR" 2>/dev/null)" != "$(stat -c %d . 2>/dev/null)" ]; then
+    setup_test_dir
+    touch "$OTHER_DEV_DIR/.DS_Store" "$OTHER_DEV_DIR/sub/.DS_Store"
+    echo -n "Test 27: Paths on several devices scanned in parallel... "
+    OUTPUT=$(./rmds -v "$TEST_DIR" "$OTHER_DEV_DIR" "$TEST_DIR/nest1")
+    if echo "$OUTPUT" | grep -q "^Scanning 2 devices in parallel with 2 workers$" && echo "$OUTPUT" | grep -q "Summary: 5 deleted, 0 failed" && [ -z "$(find "$TEST_DIR" "$OTHER_DEV_DIR" -name .DS_Store)" ]; then
+        echo "PASS"
+    else
+        echo "FAIL: Multi-device scan incorrect"
+        rm -rf "$OTHER_DEV_DIR"
+        exit 1
+    fi
+fi
+rm -rf "$OTHER_DEV_DIR"
+
+# 28. Test that the walk does not allocate per directory. Both trees
+# are copies of one 85-directory shape, 5 and 40 of them, so once the
+# first copies have warmed up the buffers and arena chunks, the other
+# directories must not allocate at all. Allocations are counted by a
+# preloaded malloc wrapper, so those libc makes are seen too. One worker
+# keeps the count exact; more would each make their own first
+# allocations. The default reader is getdents; readdir lets libc allocate
+# a stream per directory, which shows the wrapper does count them.
+rm -rf "$TEST_DIR" "$TEST_DIR2"
+mkdir -p "$TEST_DIR/shape"/d{0..3}/d{0..3}/d{0..3}
+for i in $(seq 1 40); do
+    mkdir -p "$TEST_DIR2/s$i"
+    cp -r "$TEST_DIR/shape"/d* "$TEST_DIR2/s$i"
+    if [ "$i" -le 5 ]; then
+        mkdir -p "$TEST_DIR/s$i"
+        cp -r "$TEST_DIR/shape"/d* "$TEST_DIR/s$i"
+    fi
+done
+rm -rf "$TEST_DIR/shape"
+echo -n "Test 28: Heap allocations do not grow with the tree... "
+count_mallocs() {
+    LD_PRELOAD="$PWD/tests/malloc_count.so" ./rmds -q -n -j 1 "$@" 2>&1 | sed -n 's/^malloc_count: //p'
+}
+if [ "$(uname)" != Linux ]; then
+    echo "SKIP (getdents reader and malloc wrapper are Linux only)"
+else
+    make tests/malloc_count.so > /dev/null
+    SMALL=$(count_mallocs --reader getdents "$TEST_DIR")
+    LARGE=$(count_mallocs --reader getdents "$TEST_DIR2")
+    SMALL_READDIR=$(count_mallocs --reader readdir "$TEST_DIR")
+    LARGE_READDIR=$(count_mallocs --reader readdir "$TEST_DIR2")
+    if [ -n "$SMALL" ] && [ "$LARGE" = "$SMALL" ] && [ "${LARGE_READDIR:-0}" -gt "${SMALL_READDIR:-0}" ]; then
+        echo "PASS"
+    else
+        echo "FAIL: $SMALL allocations for 426 directories, $LARGE for 3401 ($SMALL_READDIR and $LARGE_READDIR with readdir)"
+        exit 1
+    fi
+fi
+
+# 29. Test the interactive review after the scan
+setup_test_dir
+echo -n "Test 29: Interactive mode confirms after the scan... "
+# The tree is changed once the scan is over and the review is waiting
+FIFO=/tmp/rmds_test_fifo_$$
+rm -f "$FIFO"
+mkfifo "$FIFO"
+./rmds -v -i -j 2 "$TEST_DIR" < "$FIFO" > "$TEST_DIR.log" 2>&1 &
+RMDS_PID=$!
+exec 3> "$FIFO"
+for i in $(seq 1 300); do
+    grep -q "^Found 3 targets" "$TEST_DIR.log" && break
+    sleep 0.1
+done
+mv "$TEST_DIR/nest1/nest2" "$TEST_DIR/nest1/moved"
+mkdir "$TEST_DIR/nest1/nest2"
+touch "$TEST_DIR/nest1/nest2/.DS_Store"
+printf 'n\ny\na\n' >&3
+exec 3>&-
+wait $RMDS_PID || true
+OUTPUT=$(cat "$TEST_DIR.log")
+rm -f "$FIFO" "$TEST_DIR.log"
+if echo "$OUTPUT" | grep -q "^Found 3 targets in 3 directories" && echo "$OUTPUT" | grep -q "Error deleting '$TEST_DIR/nest1/nest2/.DS_Store'" && echo "$OUTPUT" | grep -q "Summary: 1 deleted, 1 failed" && [ -f "$TEST_DIR/.DS_Store" ] && [ ! -f "$TEST_DIR/nest1/.DS_Store" ] && [ -f "$TEST_DIR/nest1/nest2/.DS_Store" ] && [ -f "$TEST_DIR/nest1/moved/.DS_Store" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Interactive review did not delete the approved files"
+    exit 1
+fi
+
+# 30. Test planning and applying a cleanup
+setup_test_dir
+mkdir -p "$TEST_DIR/other"
+touch "$TEST_DIR/other/.DS_Store"
+PLAN_FILE=/tmp/rmds_test_plan_$$
+echo -n "Test 30: --plan and --apply delete only unchanged files... "
+PLANNED=$(./rmds -q -j 2 --plan "$PLAN_FILE" "$TEST_DIR" && find "$TEST_DIR" -name .DS_Store | wc -l)
+touch "$TEST_DIR/nest1/new"
+mv "$TEST_DIR/nest1/new" "$TEST_DIR/nest1/.DS_Store"
+mv "$TEST_DIR/other" "$TEST_DIR/other.old"
+mkdir "$TEST_DIR/other"
+touch "$TEST_DIR/other/.DS_Store"
+OUTPUT=$(./rmds -v --apply "$PLAN_FILE" 2>&1)
+if [ "$PLANNED" -eq 4 ] && echo "$OUTPUT" | grep -q "^Applying plan $PLAN_FILE: 4 targets in 4 directories$" && echo "$OUTPUT" | grep -q "Summary: 2 deleted, 2 failed" && [ ! -f "$TEST_DIR/.DS_Store" ] && [ ! -f "$TEST_DIR/nest1/nest2/.DS_Store" ] && [ -f "$TEST_DIR/nest1/.DS_Store" ] && [ -f "$TEST_DIR/other/.DS_Store" ] && [ -f "$TEST_DIR/other.old/.DS_Store" ] && ! ./rmds --apply "$TEST_DIR/safe_file.txt" 2> /dev/null; then
+    echo "PASS"
+else
+    echo "FAIL: Plan not applied safely"
+    rm -f "$PLAN_FILE"
+    exit 1
+fi
+rm -f "$PLAN_FILE"
+
+# 31. Test building and querying an index
+setup_test_dir
+mkdir -p "$TEST_DIR/nest1-b"
+touch "$TEST_DIR/nest1-b/.DS_Store" "$TEST_DIR/nest1/._other.c"
+INDEX_FILE=/tmp/rmds_test_index_$$
+echo -n "Test 31: --from-index answers from the index... "
+BUILT_X=$(./rmds -x --index-build "$INDEX_FILE" "$TEST_DIR" | tail -n 1)
+BUILT=$(./rmds --index-build "$INDEX_FILE" "$TEST_DIR" | tail -n 1)
+ALL=$(./rmds -n --from-index "$INDEX_FILE" | grep -c "^(dry-run) Would delete: ")
+SUBTREE=$(./rmds -n --from-index "$INDEX_FILE" "$TEST_DIR/nest1/" | sed -n "s|^(dry-run) Would delete: $TEST_DIR/||p" | tr '\n' ' ')
+CLEAN_ALL=$(./rmds -n -A --from-index "$INDEX_FILE" "$TEST_DIR/nest1" | grep -c "^(dry-run) Would delete: ")
+touch "$TEST_DIR/nest1/new"
+mv "$TEST_DIR/nest1/new" "$TEST_DIR/nest1/.DS_Store"
+OUTPUT=$(./rmds -v --from-index "$INDEX_FILE" 2>&1)
+if echo "$BUILT" | grep -q "^Indexed 10 entries, 4 targets, in $INDEX_FILE " && echo "$BUILT_X" | grep -q "^Indexed 10 entries, 4 targets, " && [ "$ALL" -eq 4 ] && [ "$SUBTREE" = "nest1/.DS_Store nest1/nest2/.DS_Store " ] && [ "$CLEAN_ALL" -eq 3 ] && echo "$OUTPUT" | grep -q "Summary: 3 deleted, 1 failed" && [ -f "$TEST_DIR/nest1/.DS_Store" ] && [ -z "$(find "$TEST_DIR" -name .DS_Store ! -path "$TEST_DIR/nest1/.DS_Store")" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Index queries incorrect"
+    rm -f "$INDEX_FILE"
+    exit 1
+fi
+rm -f "$INDEX_FILE"
+
+# 32. Test the progress reporter
+setup_test_dir
+echo -n "Test 32: --progress reports the final counts... "
+PROGRESS=$(./rmds -q -j 2 --progress "$TEST_DIR" 2>&1 > /dev/null | tail -n 1)
+if echo "$PROGRESS" | grep -q "^3 dirs, [0-9]* entries/s, 3 matched, 3 deleted, 0 errors$" && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Progress line incorrect: $PROGRESS"
+    exit 1
+fi
+
+# 33. Test the I/O throttle and idle priority
+setup_test_dir
+echo -n "Test 33: --max-dirs-per-sec waits and --idle still deletes... "
+STATS=$(./rmds -q -j 2 --max-dirs-per-sec 5 --max-ops-per-sec 1000 --idle --stats=json "$TEST_DIR" 2>&1 > /dev/null | grep "^{")
+WAITED=$(echo "$STATS" | sed 's/.*"throttled":\([0-9]*\).*/\1/')
+if [ "$WAITED" -ge 1 ] && echo "$STATS" | grep -q '"deleted":3,' && ! echo "$STATS" | grep -q '"throttle_wait_s":0.000000' && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ] && ! ./rmds -q --max-ops-per-sec 0 "$TEST_DIR" 2> /dev/null; then
+    echo "PASS"
+else
+    echo "FAIL: Throttle not applied: $STATS"
+    exit 1
+fi
+
+# 34. Test the adaptive worker count
+setup_test_dir
+echo -n "Test 34: -j auto scans and reports its workers... "
+STATS=$(./rmds -q -j auto --stats=json "$TEST_DIR" 2>&1 > /dev/null | grep "^{")
+PEAK=$(echo "$STATS" | sed 's/.*"workers_peak":\([0-9]*\).*/\1/')
+if [ "$PEAK" -ge 1 ] && [ "$PEAK" -le 64 ] && echo "$STATS" | grep -q '"deleted":3,' && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ] && ! ./rmds -q -j automatic "$TEST_DIR" 2> /dev/null; then
+    echo "PASS"
+else
+    echo "FAIL: -j auto incorrect: $STATS"
+    exit 1
+fi
+
+# 35. Test applying a plan to paths longer than PATH_MAX
+setup_test_dir
+DEEP_NAME=$(printf 'p%.0s' $(seq 1 100))
+(
+    cd "$TEST_DIR"
+    for i in $(seq 1 60); do
+        mkdir "$DEEP_NAME"
+        cd "$DEEP_NAME"
+    done
+    touch .DS_Store
+)
+PLAN_FILE=/tmp/rmds_test_plan_$$
+echo -n "Test 35: --apply reaches paths beyond 4096 bytes... "
+./rmds -q --plan "$PLAN_FILE" "$TEST_DIR"
+OUTPUT=$(./rmds -v --apply "$PLAN_FILE" 2>&1)
+rm -f "$PLAN_FILE"
+if echo "$OUTPUT" | grep -q "Summary: 4 deleted, 0 failed" && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Deep plan not applied"
+    exit 1
+fi
+
+# 36. Test deleting from an index in paths longer than PATH_MAX
+setup_test_dir
+(
+    cd "$TEST_DIR"
+    for i in $(seq 1 60); do
+        mkdir "$DEEP_NAME"
+        cd "$DEEP_NAME"
+    done
+    touch .DS_Store
+)
+INDEX_FILE=/tmp/rmds_test_index_$$
+echo -n "Test 36: --from-index reaches paths beyond 4096 bytes... "
+./rmds -q --index-build "$INDEX_FILE" "$TEST_DIR"
+ALL=$(./rmds -v --from-index "$INDEX_FILE" 2>&1)
+setup_test_dir
+(
+    cd "$TEST_DIR"
+    for i in $(seq 1 60); do
+        mkdir "$DEEP_NAME"
+        cd "$DEEP_NAME"
+    done
+    touch .DS_Store
+)
+./rmds -q --index-build "$INDEX_FILE" "$TEST_DIR"
+SUBTREE=$(./rmds -v --from-index "$INDEX_FILE" "$TEST_DIR/$DEEP_NAME" 2>&1)
+rm -f "$INDEX_FILE"
+if echo "$ALL" | grep -q "Summary: 4 deleted, 0 failed" && echo "$SUBTREE" | grep -q "Summary: 1 deleted, 0 failed" && [ -z "$(find "$TEST_DIR/$DEEP_NAME" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Deep index entries not deleted"
+    exit 1
+fi
+
+# 37. Test the interactive review in paths longer than PATH_MAX
+setup_test_dir
+(
+    cd "$TEST_DIR"
+    for i in $(seq 1 60); do
+        mkdir "$DEEP_NAME"
+        cd "$DEEP_NAME"
+    done
+    touch .DS_Store
+)
+echo -n "Test 37: -i reaches paths beyond 4096 bytes... "
+OUTPUT=$(echo a | ./rmds -v -i "$TEST_DIR" 2>&1)
+if echo "$OUTPUT" | grep -q "Summary: 4 deleted, 0 failed" && [ -z "$(find "$TEST_DIR" -name .DS_Store)" ]; then
+    echo "PASS"
+else
+    echo "FAIL: Deep target not deleted after review"
+    exit 1
+fi
+
 # Cleanup
 rm -rf "$TEST_DIR" "$TEST_DIR2"
 